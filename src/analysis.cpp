@@ -0,0 +1,341 @@
+/** Copyright (C) 2021 by Christiaan de Leeuw (CTG Lab, Vrije Universiteit Amsterdam), All Rights Reserved **/
+
+#include <algorithm>
+#include <climits>
+#include <cmath>
+#include <atomic>
+#include <thread>
+
+#include "analysis.h"
+#include "kernels.h"
+
+namespace ldblock {
+
+namespace {
+// computes metric and break points with the float band, then again after converting the band to the requested precision
+void report_precision(Settings& settings, Correlations& corrs, ostream& log) {
+  CorrelationMatrix* cm = corrs.get_matrix();
+  vector<double> reference = cm->get_metric();
+  Splitter float_analysis(settings); float_analysis.run(*cm);
+  delete cm;
+
+  corrs.convert(settings.band_precision);
+  cm = corrs.get_matrix();
+  const vector<double>& metric = cm->get_metric();
+  Splitter compact_analysis(settings); compact_analysis.run(*cm);
+
+  double max_diff = 0, sum_diff = 0;
+  for (int i = 0; i < metric.size(); i++) {
+    double diff = fabs(metric[i] - reference[i]);
+    max_diff = max(max_diff, diff); sum_diff += diff;
+  }
+  double mean_diff = metric.empty() ? 0 : sum_diff / metric.size();
+  delete cm;
+
+  vector<int> float_breaks, compact_breaks;
+  for (int i = 0; i < float_analysis.get_breaks().size(); i++) float_breaks.push_back(float_analysis.get_breaks()[i].offset);
+  for (int i = 0; i < compact_analysis.get_breaks().size(); i++) compact_breaks.push_back(compact_analysis.get_breaks()[i].offset);
+  sort(float_breaks.begin(), float_breaks.end()); sort(compact_breaks.begin(), compact_breaks.end());
+
+  int moved = 0, max_shift = 0;
+  for (int i = 0; i < compact_breaks.size(); i++) {
+    vector<int>::iterator next = lower_bound(float_breaks.begin(), float_breaks.end(), compact_breaks[i]);
+    int shift = float_breaks.empty() ? 0 : INT_MAX;
+    if (next != float_breaks.end()) shift = min(shift, *next - compact_breaks[i]);
+    if (next != float_breaks.begin()) shift = min(shift, compact_breaks[i] - *(next-1));
+    moved += shift > 0; max_shift = max(max_shift, shift);
+  }
+
+  log << "\tdeviation of " << BandPrecision::name(settings.band_precision) << " storage from float:" << endl;
+  log << "\t\tmetric: max " << max_diff << ", mean " << mean_diff << endl;
+  log << "\t\tbreak points: " << compact_breaks.size() << " (float: " << float_breaks.size() << "), " << moved << " moved, max shift " << max_shift << " SNPs" << endl;
+}
+
+Settings apply_config(const Settings& settings, const SplitConfig& config) {
+  Settings result = settings;
+  result.split_size = config.split_size; result.split_prop = config.split_prop;
+  result.metric_margin = config.metric_margin; result.metric_max = config.metric_max;
+  return result;
+}
+
+// each worker has its own copy of the matrix, as the windows of the band it indexes depend on the splits
+void sweep_worker(vector<Settings>* configs, vector<Splitter*>* analyses, CorrelationMatrix* cm, atomic<int>* next, ThreadErrors* errors) {
+  CorrelationMatrix* local = 0;
+  try {
+    local = cm->copy();
+    for (int i = (*next)++; i < configs->size(); i = (*next)++) {
+      (*analyses)[i] = new Splitter((*configs)[i]);
+      (*analyses)[i]->run(*local);
+    }
+  } catch (...) {errors->store(); *next = configs->size();}
+  delete local;
+}
+
+// all splitter settings are run on the same band; refinement reuses corrs once they are done
+int sweep(Settings& settings, GenoData& data, Correlations& corrs, CorrelationMatrix* cm, Output& out, ostream& log) {
+  int no_configs = settings.sweep.size(), no_workers = min(settings.threads, no_configs);
+  vector<Settings> configs; vector<Splitter*> analyses(no_configs, (Splitter*) 0);
+  for (int i = 0; i < no_configs; i++) configs.push_back(apply_config(settings, settings.sweep[i]));
+
+  log << "Computing break points for " << no_configs << " splitter settings..." << endl;
+  atomic<int> next(0); ThreadErrors errors;
+  if (no_workers > 1) {
+    vector<thread> workers;
+    for (int t = 0; t < no_workers; t++) workers.push_back(thread(sweep_worker, &configs, &analyses, cm, &next, &errors));
+    for (int t = 0; t < no_workers; t++) workers[t].join();
+  } else sweep_worker(&configs, &analyses, cm, &next, &errors);
+  delete cm;
+  if (errors.failed()) {
+    for (int i = 0; i < no_configs; i++) delete analyses[i];
+    errors.rethrow();
+  }
+
+  vector<pair<int,int> > positions = corrs.get_positions();
+  int total = 0;
+  for (int i = 0; i < no_configs; i++) {
+    Settings& config = configs[i]; const vector<Split>& breaks = analyses[i]->get_breaks();
+    ostringstream name; name << "min" << config.split_size << "_prop" << config.split_prop << "_margin" << config.metric_margin << "_max" << config.metric_max;
+    log << "\t" << name.str() << ": found " << breaks.size() << " break points" << endl;
+    
+    if (!breaks.empty()) {
+      Output curr(out.get_prefix() + "." + name.str(), log);
+      if (settings.refine) {
+        Refiner refiner(data, settings);
+        refiner.refine(breaks, positions, corrs);
+        curr.write(refiner.get_breaks(), refiner.get_positions(), data);
+      } else curr.write(breaks, positions, data);
+      if (!settings.block_filters.empty()) curr.write_blocks(curr.get_rows(), settings.block_filters);
+    }
+    total += breaks.size();
+    delete analyses[i];
+  }
+  return total;
+}
+
+// counters of the correlation pass, shared by all stages after it
+void add_counters(RunReport& report, GenoData& data, Correlations& corrs, bool computed) {
+  report.add_counter("snps_total", data.get_nsnps());
+  report.add_counter("snps_retained", corrs.get_size());
+  report.add_counter("snps_filtered", data.get_nsnps() - corrs.get_size());
+  report.add_counter("r2_pairs", corrs.get_pairs());
+  report.add_counter("storage_chunks", corrs.get_chunks());
+  report.add_counter("band_bytes", corrs.get_band_bytes());
+  if (computed) {
+    report.add_counter("snps_read", corrs.get_snps_read());
+    report.add_counter("bytes_read", (double) corrs.get_snps_read() * data.get_snp_bytes());
+    report.add_counter("decode_seconds", corrs.get_decode_time());
+    report.add_counter("stall_seconds", corrs.get_stall_time());
+  }
+  report.add_counter("bim_parse_seconds", data.get_bim_time());
+}
+
+
+// reads the pair statistics of all batches, the input data only has to have the same SNPs
+PairStats* merge_stats(Settings& settings, GenoData& data, ostream& log) {
+  vector<PairStats*> batches; PairStats* merged = 0;
+  try {
+    for (int i = 0; i < settings.merge_stats.size(); i++) {
+      batches.push_back(new PairStats(settings.merge_stats[i], data));
+      log << "\t" << settings.merge_stats[i] << ": " << batches.back()->get_nindiv() << " individuals, window = " << batches.back()->get_window() << endl;
+    }
+    merged = new PairStats(batches);
+  } catch (...) {
+    for (int i = 0; i < batches.size(); i++) delete batches[i];
+    throw;
+  }
+  for (int i = 0; i < batches.size(); i++) delete batches[i];
+  return merged;
+}
+
+// only the pair statistics of the individuals, or those of the merged batches, are computed to be merged again later
+int save_stats(Settings& settings, GenoData& data, Output& out, ostream& log, RunReport& report) {
+  Timer timer; PairStats* stats;
+  if (!settings.merge_stats.empty()) {
+    log << "Merging pair statistics of " << settings.merge_stats.size() << " batch(es)..." << endl;
+    stats = merge_stats(settings, data, log);
+  } else {
+    log << "Computing pair statistics..." << endl;
+    if (settings.threads > 1) log << "\tthreads = " << settings.threads << endl;
+    stats = new PairStats(data, settings.stats_window, settings.threads, settings.snp_window, settings.get_stats_maf());
+    if (stats->get_common() >= 0) log << "\t" << stats->get_common() << " SNPs with MAF of at least " << settings.get_stats_maf() << " in this batch" << endl;
+  }
+  log << "\twindow = " << stats->get_window() << " SNPs before filtering" << endl;
+  try {stats->save(settings.save_stats);}
+  catch (...) {delete stats; throw;}
+
+  report.add_stage("pair_stats", timer);
+  report.add_counter("snps_total", data.get_nsnps());
+  report.add_counter("stats_pairs", stats->get_pairs()); report.add_counter("stats_triples", stats->get_triples());
+  log << "\t" << stats->get_nindiv() << " individuals, " << stats->get_size() << " SNPs, " << stats->get_pairs() << " pairs (" << stats->get_triples() << " with missing genotypes)" << endl;
+  log << "\tsaved pair statistics to file '" << settings.save_stats << "'" << endl;
+  log << endl;
+  delete stats;
+
+  out.write_report(report);
+  return 0;
+}
+
+}
+
+int analyse(Settings& settings, GenoData& data, Output& out, ostream& log, RunReport& report) {
+  if (out.in_memory() && !settings.sweep.empty()) error("a sweep of splitter settings writes its results to files, and cannot be kept in memory");
+  report.add_info("input", settings.input_pref); report.add_info("output", out.get_prefix());
+  ostringstream window, maf; window << settings.snp_window; maf << settings.maf_thresh;
+  report.add_info("window", window.str()); report.add_info("maf_threshold", maf.str());
+
+  if (!settings.save_stats.empty()) return save_stats(settings, data, out, log, report);
+
+  bool loaded = !settings.load_band.empty() || !settings.merge.empty() || !settings.merge_stats.empty(), shard = settings.shard_from >= 0;
+  if (!settings.load_band.empty()) log << "Loading correlations from file '" << settings.load_band << "'..." << endl;
+  else if (!settings.merge_stats.empty()) log << "Computing correlations from the pair statistics of " << settings.merge_stats.size() << " batch(es)..." << endl;
+  else if (loaded) log << "Merging correlations from " << settings.merge.size() << " band shard(s)..." << endl;
+  else if (shard) log << "Computing correlations for SNPs " << settings.shard_from << " to " << settings.shard_to - 1 << "..." << endl;
+  else log << "Computing correlations..." << endl;
+  log << "\twindow = " << settings.snp_window << endl;
+  log << "\tMAF threshold = " << settings.maf_thresh << endl;
+
+  bool report_prec = settings.precision_report && settings.band_precision != BandPrecision::float32 && !loaded;
+  Settings compute_settings = settings;
+  if (report_prec) compute_settings.band_precision = BandPrecision::float32;
+
+  GenoData* approx = settings.subsample > 0 && settings.subsample < data.get_nrow() ? data.get_subsample(settings.subsample, settings.seed) : 0;
+  GenoData& band_data = approx ? *approx : data;
+  if (approx) log << "\tapproximating with " << approx->get_nrow() << " of " << data.get_nrow() << " individuals (seed " << settings.seed << ")" << endl;
+
+  Timer timer;
+  Correlations corrs(compute_settings);
+  if (!settings.load_band.empty()) {
+    corrs.load_band(settings.load_band, band_data);
+    report.add_stage("load_band", timer);
+  } else if (!settings.merge_stats.empty()) {
+    PairStats* merged = merge_stats(settings, band_data, log);
+    try {corrs.compute_stats(*merged, band_data);}
+    catch (...) {delete merged; throw;}
+    delete merged;
+    report.add_stage("merge_stats", timer);
+  } else if (loaded) {
+    corrs.merge_shards(settings.merge, band_data);
+    report.add_stage("merge_shards", timer);
+  } else {
+    if (settings.threads > 1) log << "\tthreads = " << settings.threads << endl;
+    if (settings.packed) log << "\tusing bit-packed genotypes" << endl;
+    else log << "\tusing " << Kernels::level_name(corrs.get_kernel()) << " kernel" << endl;
+    corrs.set_progress(&log, settings.progress);
+    if (shard && settings.shard_to > band_data.get_nsnps()) error("range of argument '-shard' exceeds the number of SNPs (" + DataUtils::to_string(band_data.get_nsnps()) + ")");
+    if (shard) corrs.compute_shard(band_data, settings.shard_from, settings.shard_to);
+    else corrs.compute(band_data);
+    report.add_stage("correlations", timer);
+  }
+  log << "\tretained " << corrs.get_size() << " SNPs after filtering" << endl;
+  if (!loaded) log << "\ttime waiting for genotype data: " << corrs.get_stall_time() << "s" << (settings.prefetch > 0 ? "" : " (no prefetching)") << endl;
+  if (report_prec) {
+    timer.reset();
+    report_precision(settings, corrs, log);
+    report.add_stage("precision_report", timer);
+  }
+  log << "\tband storage: " << corrs.get_band_bytes() / 1048576.0 << " MB (" << BandPrecision::name(corrs.get_precision()) << "), "
+      << corrs.get_split_bytes() / 1048576.0 << " MB more while splitting" << endl;
+  if (corrs.is_spilled()) log << "\tband exceeds memory limit of " << settings.mem_limit << " MB, spilled to temporary files in '" << settings.tmp_dir << "'" << endl;
+  if (!settings.save_band.empty()) {
+    timer.reset();
+    corrs.save_band(settings.save_band, band_data);
+    report.add_stage("save_band", timer);
+    log << "\tsaved correlations to file '" << settings.save_band << "'" << endl;
+  }
+  add_counters(report, band_data, corrs, !loaded);
+  log << endl;
+
+  if (shard) { //break points are only computed after merging the shards
+    out.write_report(report);
+    delete approx;
+    return 0;
+  }
+
+  timer.reset();
+  CorrelationMatrix* cm = corrs.get_matrix();
+  report.add_stage("metric", timer);
+
+  if (settings.print_metric) {
+    out.write_metrics(cm->get_metric());
+    log << endl;
+  }
+
+  int breaks;
+  if (!settings.sweep.empty()) {
+    timer.reset();
+    breaks = sweep(settings, data, corrs, cm, out, log);
+    report.add_stage("sweep", timer);
+  } else {
+    Splitter analysis(settings);
+    log << "Computing break points..." << endl;
+    log << "\tminimum size = " << settings.split_size << endl;
+    log << "\tminimum proportion = " << settings.split_prop << endl;
+    log << "\tmetric margin = " << settings.metric_margin << endl;
+    log << "\tmetric maximum = " << min(settings.metric_max, 1.0) << endl;
+
+    timer.reset();
+    breaks = analysis.run(*cm);
+    delete cm;
+    report.add_stage("splitting", timer);
+    if (breaks > 0) {
+      log << "\tfound " << breaks << " break points" << endl;
+      log << endl;
+
+      vector<Split> found = analysis.get_breaks(); vector<pair<int,int> > positions = corrs.get_positions();
+      if (approx) {
+        MetricCheck check(data, settings);
+        log << "Computing exact metric at break points..." << endl;
+        timer.reset();
+        check.run(found, positions, corrs);
+        report.add_stage("exact_check", timer);
+
+        double max_diff = 0, sum_diff = 0;
+        for (int b = 0; b < breaks; b++) {
+          double diff = fabs(check.get_approx()[b] - check.get_breaks()[b].metric);
+          max_diff = max(max_diff, diff); sum_diff += diff;
+        }
+        log << "\tdeviation of approximate from exact metric: max " << max_diff << ", mean " << sum_diff / breaks << endl;
+        report.add_counter("approx_max_deviation", max_diff); report.add_counter("approx_mean_deviation", sum_diff / breaks);
+        out.write_approx(check.get_breaks(), check.get_approx(), positions);
+        found = check.get_breaks();
+        log << endl;
+      }
+
+      if (settings.refine) {
+        Refiner refiner(data, settings);
+        log << "Refining break points for unfiltered data..." << endl;
+        timer.reset();
+        refiner.refine(found, positions, corrs);
+        report.add_stage("refinement", timer);
+        timer.reset();
+        out.write(refiner.get_breaks(), refiner.get_positions(), data);
+      } else {
+        timer.reset();
+        out.write(found, positions, data);
+      }
+      if (!settings.block_filters.empty()) out.write_blocks(out.get_rows(), settings.block_filters);
+      report.add_stage("output", timer);
+    }
+  }
+
+  report.add_counter("break_points", max(breaks, 0));
+  out.write_report(report);
+  delete approx;
+  return breaks;
+}
+
+vector<BreakPoint> find_breaks(const Settings& settings, GenoData& data, ostream& log) {
+  settings.check();
+  Settings config = settings;
+  if (config.maf_thresh == 0) config.refine = false;
+
+  Output out(log); RunReport report;
+  float thresh = data.get_thresh();
+  data.set_thresh(config.maf_thresh);
+  try {analyse(config, data, out, log, report);}
+  catch (...) {data.set_thresh(thresh); throw;}
+  data.set_thresh(thresh);
+  return out.get_breakpoints();
+}
+
+} // namespace ldblock
@@ -0,0 +1,26 @@
+/** Copyright (C) 2021 by Christiaan de Leeuw (CTG Lab, Vrije Universiteit Amsterdam), All Rights Reserved **/
+
+#ifndef ANALYSIS_H
+#define ANALYSIS_H
+
+#include "global.h"
+#include "data.h"
+#include "correlations.h"
+#include "splitter.h"
+#include "output.h"
+#include "report.h"
+
+namespace ldblock {
+
+// full analysis of a single chromosome, returns the number of break points (output is only written if there are any)
+// for a shard, only the band of its SNPs is computed and saved
+// stage timings and counters are added to report, which is written to <out>.run.json at the end
+int analyse(Settings& settings, GenoData& data, Output& out, ostream& log, RunReport& report);
+
+// the same analysis without writing any files, returning the break points in order of position (empty if none are found)
+// settings are checked first, data is filtered on the MAF threshold of settings and keeps its own threshold afterwards; errors are thrown as LdblockError
+vector<BreakPoint> find_breaks(const Settings& settings, GenoData& data, ostream& log);
+
+} // namespace ldblock
+
+#endif /* ANALYSIS_H */
@@ -0,0 +1,296 @@
+/** Copyright (C) 2021 by Christiaan de Leeuw (CTG Lab, Vrije Universiteit Amsterdam), All Rights Reserved **/
+
+// benchmark of the main computational stages on a synthetic PLINK fileset, with results written as JSON
+// the stages with vectorized or bit-packed variants are checked against the scalar reference path
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <random>
+
+#include "global.h"
+#include "data.h"
+#include "correlations.h"
+#include "kernels.h"
+#include "splitter.h"
+
+using namespace ldblock;
+
+namespace {
+  struct BenchSettings {
+    string prefix, out_file;
+    int no_indiv, no_snps, window, min_size, reps; unsigned int seed;
+    double missing, maf_min, maf_max, block_length, switch_rate, tolerance;
+
+    BenchSettings(int argc, char* argv[]);
+  };
+
+  template<typename T>
+  bool convert_num(const string& value, T& target) {
+    istringstream istr(value); istr >> target;
+    return !istr.fail() && istr.eof();
+  }
+
+  BenchSettings::BenchSettings(int argc, char* argv[]) : prefix("ldblock_bench_data"), out_file("ldblock_bench.json"), no_indiv(1000), no_snps(20000), window(200), min_size(500), reps(3), seed(1),
+      missing(0.01), maf_min(0.005), maf_max(0.5), block_length(150), switch_rate(0.01), tolerance(1e-4) {
+    for (int a = 1; a < argc; a++) {
+      string arg = argv[a];
+      if (argc <= a+1) error(string("no value specified for argument '") + arg + "'");
+      string value = argv[++a]; bool valid = true;
+
+      if (arg == "-data") prefix = value;
+      else if (arg == "-out") out_file = value;
+      else if (arg == "-n") valid = convert_num(value, no_indiv) && no_indiv >= 10;
+      else if (arg == "-snps") valid = convert_num(value, no_snps) && no_snps >= 100;
+      else if (arg == "-win") valid = convert_num(value, window) && window >= 1;
+      else if (arg == "-min-size") valid = convert_num(value, min_size) && min_size >= 50;
+      else if (arg == "-reps") valid = convert_num(value, reps) && reps >= 1;
+      else if (arg == "-seed") valid = convert_num(value, seed);
+      else if (arg == "-missing") valid = convert_num(value, missing) && missing >= 0 && missing < 1;
+      else if (arg == "-maf-min") valid = convert_num(value, maf_min) && maf_min >= 0 && maf_min <= 0.5;
+      else if (arg == "-maf-max") valid = convert_num(value, maf_max) && maf_max >= 0 && maf_max <= 0.5;
+      else if (arg == "-block") valid = convert_num(value, block_length) && block_length >= 1;
+      else if (arg == "-switch") valid = convert_num(value, switch_rate) && switch_rate >= 0 && switch_rate <= 1;
+      else if (arg == "-tol") valid = convert_num(value, tolerance) && tolerance >= 0;
+      else error(string("unknown argument '") + arg + "'");
+      if (!valid) error(string("invalid value for argument '") + arg + "'");
+    }
+    if (maf_min > maf_max) error("value for argument '-maf-min' cannot exceed that of '-maf-max'");
+  }
+
+
+  // haplotype blocks of geometric length; each block has a few founder haplotypes with allele frequencies from the MAF range,
+  // and every chromosome copies one founder while switching to another at each SNP with the switch rate, so LD decays with distance
+  void generate(const BenchSettings& bs) {
+    mt19937_64 rng(bs.seed);
+    uniform_real_distribution<double> unif(0, 1);
+    geometric_distribution<int> block_length(1.0 / bs.block_length);
+    uniform_int_distribution<int> founder_count(2, 6), spacing(1, 300);
+
+    ofstream fam((bs.prefix + ".fam").c_str()), bim((bs.prefix + ".bim").c_str()), bed((bs.prefix + ".bed").c_str(), ios::binary);
+    for (int i = 0; i < bs.no_indiv; i++) fam << "F" << i << " I" << i << " 0 0 0 -9\n";
+    const char magic[3] = {108, 27, 1}; bed.write(magic, 3);
+
+    int bytes = (bs.no_indiv + 3) / 4, pos = 1000, snp = 0;
+    vector<char> raw(bytes); vector<int> copy(2*bs.no_indiv);
+    while (snp < bs.no_snps) {
+      int length = block_length(rng) + 1, no_founders = founder_count(rng);
+      uniform_int_distribution<int> pick(0, no_founders-1);
+      for (int h = 0; h < copy.size(); h++) copy[h] = pick(rng);
+
+      for (int l = 0; l < length && snp < bs.no_snps; l++, snp++) {
+        double maf = bs.maf_min + (bs.maf_max - bs.maf_min) * unif(rng) * unif(rng);
+        vector<bool> founder(no_founders);
+        for (int f = 0; f < no_founders; f++) founder[f] = unif(rng) < maf;
+
+        memset(&raw[0], 0, bytes);
+        for (int i = 0; i < bs.no_indiv; i++) {
+          for (int k = 0; k < 2; k++) {if (unif(rng) < bs.switch_rate) copy[2*i+k] = pick(rng);}
+          int geno = founder[copy[2*i]] + founder[copy[2*i+1]], code = geno == 0 ? 0 : (geno == 1 ? 2 : 3);
+          if (unif(rng) < bs.missing) code = 1;
+          raw[i/4] |= code << (2*(i%4));
+        }
+        bed.write(&raw[0], bytes);
+        pos += spacing(rng);
+        bim << "1\trs" << snp << "\t0\t" << pos << "\tA\tG\n";
+      }
+    }
+  }
+
+
+  typedef chrono::steady_clock Clock;
+  double seconds_since(Clock::time_point start) {return chrono::duration<double>(Clock::now() - start).count();}
+
+  struct Result {
+    string stage, variant, unit; double min_time, median_time, work;
+    Result(const string& stage, const string& variant, vector<double> times, double work, const string& unit) : stage(stage), variant(variant), unit(unit), work(work) {
+      sort(times.begin(), times.end());
+      min_time = times[0]; median_time = times[times.size()/2];
+    }
+  };
+
+  struct Check {
+    string name; double max_metric_diff; bool breaks_equal, pass;
+    Check(const string& name, double diff, bool equal, double tol) : name(name), max_metric_diff(diff), breaks_equal(equal), pass(diff <= tol) {}
+  };
+
+  // discards the progress messages of the library while timing
+  struct Quiet {
+    ostringstream sink; streambuf* saved;
+    Quiet() : saved(cout.rdbuf(sink.rdbuf())) {}
+    ~Quiet() {cout.rdbuf(saved);}
+  };
+
+  Settings make_settings(const BenchSettings& bs, const string& extra) {
+    istringstream extract(extra); vector<string> args; string value;
+    args.push_back("ldblock"); args.push_back(bs.prefix);
+    args.push_back("-win"); args.push_back(DataUtils::to_string(bs.window));
+    args.push_back("-min-size"); args.push_back(DataUtils::to_string(bs.min_size));
+    while (extract >> value) args.push_back(value);
+
+    vector<char*> argv;
+    for (int i = 0; i < args.size(); i++) argv.push_back(&args[i][0]);
+    return Settings(argv.size(), &argv[0]);
+  }
+
+  vector<int> break_offsets(Splitter& analysis) {
+    vector<int> offsets;
+    for (int i = 0; i < analysis.get_breaks().size(); i++) offsets.push_back(analysis.get_breaks()[i].offset);
+    return offsets;
+  }
+}
+
+
+int run(int argc, char* argv[]) {
+  BenchSettings bs(argc, argv);
+  vector<Result> results; vector<Check> checks;
+
+  cout << "Generating synthetic data '" << bs.prefix << "' (" << bs.no_indiv << " individuals, " << bs.no_snps << " SNPs)..." << endl;
+  Clock::time_point start = Clock::now();
+  generate(bs);
+  results.push_back(Result("generate", "", vector<double>(1, seconds_since(start)), bs.no_snps, "SNPs"));
+
+  Quiet* quiet = new Quiet();
+  Settings base = make_settings(bs, "-simd 0");
+  GenoData data(bs.prefix, base.maf_thresh);
+  delete quiet;
+
+  cout << "Timing genotype decoding..." << endl;
+  for (int packed = 0; packed < 2; packed++) {
+    vector<double> times; GenoData::Reader reader(data);
+    Buffer<float> values; Buffer<PackedWord> words; vector<pair<int,int> > positions;
+    for (int r = 0; r < bs.reps; r++) {
+      start = Clock::now();
+      for (int offset = 0; offset < data.get_nsnps(); ) {
+        positions.clear();
+        pair<int,int> count = packed ? reader.load_data(words, positions, offset, 1000) : reader.load_data(values, positions, offset, 1000);
+        if (count.second == 0) break;
+        offset += count.second;
+      }
+      times.push_back(seconds_since(start));
+    }
+    results.push_back(Result("decode", packed ? "packed" : "float", times, data.get_nsnps(), "SNPs"));
+  }
+
+  cout << "Timing correlation kernels..." << endl;
+  {
+    int n = data.get_nrow(), leads = 16, trails = bs.window, max_level = Kernels::detect_level();
+    vector<float> columns((long long) (leads + trails) * n); vector<float*> cols(leads + trails); vector<double> out(leads * trails);
+    mt19937 rng(bs.seed); normal_distribution<float> norm;
+    for (int i = 0; i < columns.size(); i++) columns[i] = norm(rng);
+    for (int i = 0; i < cols.size(); i++) cols[i] = &columns[(long long) i*n];
+
+    int repeat = max(1, int(2e8 / ((double) leads * trails * n)));
+    for (int level = Kernels::scalar; level <= max_level; level++) {
+      vector<double> times;
+      for (int r = 0; r < bs.reps; r++) {
+        start = Clock::now();
+        for (int k = 0; k < repeat; k++) Kernels::dot_tile(level, &cols[0], leads, &cols[leads], trails, n, &out[0]);
+        times.push_back(seconds_since(start));
+      }
+      results.push_back(Result("dot_tile", Kernels::level_name(level), times, (double) repeat * leads * trails, "pairs"));
+    }
+  }
+
+  cout << "Timing correlation band, metric and splitter..." << endl;
+  const char* variants[] = {"scalar", "simd", "packed"}; const char* extra[] = {"-simd 0", "-simd 1", "-packed"};
+  vector<double> reference_metric; vector<int> reference_breaks;
+  for (int v = 0; v < 3; v++) {
+    Settings settings = make_settings(bs, extra[v]);
+    Correlations corrs(settings);
+    vector<double> band_times, metric_times, split_times;
+    vector<double> metric; vector<int> breaks; long long pairs = 0;
+
+    for (int r = 0; r < bs.reps; r++) {
+      start = Clock::now();
+      corrs.compute(data);
+      band_times.push_back(seconds_since(start));
+
+      start = Clock::now();
+      CorrelationMatrix* cm = corrs.get_matrix();
+      metric_times.push_back(seconds_since(start));
+      metric = cm->get_metric();
+
+      Splitter analysis(settings);
+      start = Clock::now();
+      analysis.run(*cm);
+      split_times.push_back(seconds_since(start));
+      breaks = break_offsets(analysis);
+      delete cm;
+    }
+    for (int i = 0; i < corrs.get_size(); i++) pairs += min(i, bs.window);
+
+    string name = variants[v];
+    if (v == 1) name += string(" (") + Kernels::level_name(corrs.get_kernel()) + ")";
+    results.push_back(Result("correlations", name, band_times, pairs, "pairs"));
+    results.push_back(Result("metric", name, metric_times, corrs.get_size(), "SNPs"));
+    results.push_back(Result("splitter", name, split_times, corrs.get_size(), "SNPs"));
+
+    if (v == 0) {reference_metric = metric; reference_breaks = breaks; continue;}
+    double diff = metric.size() == reference_metric.size() ? 0 : HUGE_VAL;
+    for (int i = 0; i < metric.size() && i < reference_metric.size(); i++) diff = max(diff, fabs(metric[i] - reference_metric[i]));
+    checks.push_back(Check(name + " vs scalar", diff, breaks == reference_breaks, bs.tolerance));
+  }
+
+  cout << "Timing refinement..." << endl;
+  {
+    Settings settings = make_settings(bs, "-simd 0");
+    vector<double> times; int no_breaks = 0;
+    for (int r = 0; r < bs.reps; r++) {
+      Correlations corrs(settings); data.set_thresh(settings.maf_thresh);
+      corrs.compute(data);
+      CorrelationMatrix* cm = corrs.get_matrix();
+      Splitter analysis(settings); no_breaks = analysis.run(*cm);
+      delete cm;
+
+      Refiner refiner(data, settings);
+      start = Clock::now();
+      refiner.refine(analysis, corrs);
+      times.push_back(seconds_since(start));
+    }
+    results.push_back(Result("refine", "", times, no_breaks, "breaks"));
+    data.set_thresh(settings.maf_thresh);
+  }
+
+
+  bool pass = true;
+  for (int i = 0; i < checks.size(); i++) pass = pass && checks[i].pass;
+
+  ofstream out(bs.out_file.c_str());
+  out.precision(6);
+  out << "{\n  \"config\": {\"individuals\": " << bs.no_indiv << ", \"snps\": " << bs.no_snps << ", \"window\": " << bs.window << ", \"min_size\": " << bs.min_size
+      << ", \"missing\": " << bs.missing << ", \"maf_min\": " << bs.maf_min << ", \"maf_max\": " << bs.maf_max << ", \"block_length\": " << bs.block_length
+      << ", \"switch_rate\": " << bs.switch_rate << ", \"reps\": " << bs.reps << ", \"seed\": " << bs.seed << "},\n";
+  out << "  \"results\": [\n";
+  for (int i = 0; i < results.size(); i++) {
+    Result& res = results[i];
+    out << "    {\"stage\": \"" << res.stage << "\", \"variant\": \"" << res.variant << "\", \"min_seconds\": " << res.min_time << ", \"median_seconds\": " << res.median_time
+        << ", \"work\": " << res.work << ", \"unit\": \"" << res.unit << "\", \"per_second\": " << (res.min_time > 0 ? res.work / res.min_time : 0) << "}" << (i+1 < results.size() ? "," : "") << "\n";
+  }
+  out << "  ],\n  \"checks\": [\n";
+  for (int i = 0; i < checks.size(); i++) {
+    Check& check = checks[i];
+    out << "    {\"name\": \"" << check.name << "\", \"max_metric_diff\": " << check.max_metric_diff << ", \"breaks_equal\": " << (check.breaks_equal ? "true" : "false")
+        << ", \"pass\": " << (check.pass ? "true" : "false") << "}" << (i+1 < checks.size() ? "," : "") << "\n";
+  }
+  out << "  ],\n  \"pass\": " << (pass ? "true" : "false") << "\n}\n";
+
+  cout << endl;
+  for (int i = 0; i < results.size(); i++) {
+    Result& res = results[i];
+    cout << "\t" << res.stage << (res.variant.empty() ? "" : " [" + res.variant + "]") << ": " << res.min_time << "s (" << (res.min_time > 0 ? res.work / res.min_time : 0) << " " << res.unit << "/s)" << endl;
+  }
+  for (int i = 0; i < checks.size(); i++) cout << "\tcheck " << checks[i].name << ": metric difference " << checks[i].max_metric_diff << ", break points " << (checks[i].breaks_equal ? "equal" : "differ") << (checks[i].pass ? "" : " FAILED") << endl;
+  cout << "Results written to '" << bs.out_file << "'" << endl;
+
+  return pass ? 0 : 1;
+}
+
+int main(int argc, char* argv[]) {
+  try {
+    return run(argc, argv);
+  } catch (LdblockError& e) {
+    cerr << endl << "ERROR: " << e.what() << endl;
+    return e.get_code();
+  }
+}
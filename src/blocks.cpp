@@ -0,0 +1,98 @@
+/** Copyright (C) 2021 by Christiaan de Leeuw (CTG Lab, Vrije Universiteit Amsterdam), All Rights Reserved **/
+
+#include <algorithm>
+#include <map>
+
+#include "blocks.h"
+#include "data.h"
+
+namespace ldblock {
+
+// the block a break point splits is the leaf between the lines of the break points before and after it that have a lower rank
+BreakTree::BreakTree(const vector<BreakPoint>& input) : rows(input) {
+  int size = rows.size();
+  if (size < 2 || rows[0].rank != 0 || rows[size-1].rank != 0) error("break points should start and end with a line of rank 0");
+
+  vector<pair<int,int> > order;
+  for (int i = 1; i < size-1; i++) {
+    if (rows[i].rank <= 0) error("break points other than the first and last should have a positive rank");
+    order.push_back(pair<int,int>(rows[i].rank, i));
+  }
+  sort(order.begin(), order.end());
+  for (int i = 1; i < order.size(); i++) {if (order[i].first == order[i-1].first) error("rank " + DataUtils::to_string(order[i].first) + " occurs more than once in break points");}
+
+  map<int, pair<int,int> > leaves; //low line of each leaf, with its high line and the node that created it
+  leaves[0] = pair<int,int>(size-1, -1);
+  for (int i = 0; i < order.size(); i++) {
+    int row = order[i].second;
+    map<int, pair<int,int> >::iterator leaf = --leaves.upper_bound(row);
+    int low = leaf->first, high = leaf->second.first;
+
+    nodes.push_back(Node(row, leaf->second.second, low, high));
+    leaf->second = pair<int,int>(row, i); leaves[row] = pair<int,int>(high, i);
+  }
+}
+
+vector<bool> BreakTree::keep_rows(const BlockFilter& filter) {
+  vector<bool> keep(rows.size(), false), kept(nodes.size(), false);
+  keep.front() = keep.back() = true;
+
+  int no_kept = 0;
+  for (int k = 0; k < nodes.size(); k++) {
+    Node& node = nodes[k]; BreakPoint &low = rows[node.low], &curr = rows[node.row], &high = rows[node.high];
+    bool sizes = curr.index_filt - low.index_filt >= filter.min_size && high.index_filt - curr.index_filt >= filter.min_size
+      && curr.index_all - low.index_all >= filter.min_size_all && high.index_all - curr.index_all >= filter.min_size_all;
+    kept[k] = (node.parent < 0 || kept[node.parent]) && curr.metric_min <= filter.max_metric && sizes;
+    if (kept[k] && (filter.max_blocks <= 0 || no_kept < filter.max_blocks - 1)) {keep[node.row] = true; no_kept++;}
+  }
+  return keep;
+}
+
+vector<BreakPoint> BreakTree::filter(const BlockFilter& filter) {
+  vector<bool> keep = keep_rows(filter);
+  vector<BreakPoint> result;
+  for (int i = 0; i < rows.size(); i++) {if (keep[i]) result.push_back(rows[i]);}
+  return result;
+}
+
+vector<LdBlock> BreakTree::make_blocks(const BlockFilter& filter) {
+  vector<BreakPoint> kept = this->filter(filter);
+  vector<LdBlock> blocks(kept.size() - 1);
+  for (int i = 0; i < blocks.size(); i++) {
+    blocks[i].start = kept[i].position; blocks[i].stop = kept[i+1].position - 1;
+    blocks[i].size_filt = kept[i+1].index_filt - kept[i].index_filt;
+    blocks[i].size_all = kept[i+1].index_all - kept[i].index_all;
+  }
+  return blocks;
+}
+
+vector<vector<LdBlock> > BreakTree::make_blocks(const vector<BlockFilter>& filters) {
+  vector<vector<LdBlock> > result;
+  for (int f = 0; f < filters.size(); f++) result.push_back(make_blocks(filters[f]));
+  return result;
+}
+
+// lines are put in order of position; NA is read as -1
+vector<BreakPoint> BreakTree::read(const string& fname) {
+  ifstream in(fname.c_str());
+  if (!in.good()) error(string("unable to open break point file '") + fname + "'");
+
+  string line, header = "RANK\tMETRIC\tMETRIC_MIN\tINDEX_FILT\tINDEX_ALL\tPOSITION\tPOS_LOWER\tPOS_UPPER";
+  if (!getline(in, line) || line != header) error(string("file '") + fname + "' is not a break point file");
+
+  vector<pair<int,int> > order; vector<BreakPoint> input;
+  for (int line_no = 2; getline(in, line); line_no++) {
+    if (line.empty()) continue;
+    istringstream extract(line); BreakPoint curr; string lower, upper;
+    if (!(extract >> curr.rank >> curr.metric >> curr.metric_min >> curr.index_filt >> curr.index_all >> curr.position >> lower >> upper)) error(string("invalid values on line ") + DataUtils::to_string(line_no) + " of file '" + fname + "'");
+    curr.pos_lower = lower == "NA" ? -1 : atoi(lower.c_str()); curr.pos_upper = upper == "NA" ? -1 : atoi(upper.c_str());
+    order.push_back(pair<int,int>(curr.index_filt, input.size())); input.push_back(curr);
+  }
+
+  stable_sort(order.begin(), order.end());
+  vector<BreakPoint> rows;
+  for (int i = 0; i < order.size(); i++) rows.push_back(input[order[i].second]);
+  return rows;
+}
+
+} // namespace ldblock
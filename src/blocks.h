@@ -0,0 +1,53 @@
+/** Copyright (C) 2021 by Christiaan de Leeuw (CTG Lab, Vrije Universiteit Amsterdam), All Rights Reserved **/
+
+#ifndef BLOCKS_H
+#define BLOCKS_H
+
+#include <vector>
+
+#include "global.h"
+
+namespace ldblock {
+
+// a line of the .breaks file; rank is the order in which the break point was found, 0 for the two ends of the data
+struct BreakPoint {
+  int rank; double metric, metric_min;
+  int index_filt, index_all; //SNP before the break, after filtering and in the full data
+  int position, pos_lower, pos_upper; //base pair position of the break, and of the SNPs on either side of it (-1 for NA)
+};
+
+// bounds are inclusive, sizes are the differences in index between the break points on either side
+struct LdBlock {
+  int start, stop;
+  int size_filt, size_all;
+};
+
+// binary tree of the blocks that were successively split, in order of rank; as build.tree, filter.breaks and make.blocks in ldblock.r
+// a break point is kept if its METRIC_MIN is at most max_metric, both blocks it creates have at least min_size SNPs after filtering
+// and min_size_all SNPs in total, and the break point that created its block is kept; of those, only the first max_blocks - 1 in
+// order of rank are kept if max_blocks > 0
+class BreakTree {
+  struct Node {
+    int row, parent; //line of the break point, and node of the break point that created the block it splits (-1 for none)
+    int low, high; //lines at the ends of the block it splits
+    Node(int row, int parent, int low, int high) : row(row), parent(parent), low(low), high(high) {}
+  };
+
+  vector<BreakPoint> rows; //in order of position
+  vector<Node> nodes; //in order of rank, so that parents precede their children
+
+  vector<bool> keep_rows(const BlockFilter& filter);
+
+public:
+  BreakTree(const vector<BreakPoint>& rows); //lines of a .breaks file in order of position, including the two lines with rank 0
+
+  static vector<BreakPoint> read(const string& fname);
+
+  vector<BreakPoint> filter(const BlockFilter& filter); //lines that are kept, including the two with rank 0
+  vector<LdBlock> make_blocks(const BlockFilter& filter);
+  vector<vector<LdBlock> > make_blocks(const vector<BlockFilter>& filters);
+};
+
+} // namespace ldblock
+
+#endif /* BLOCKS_H */
@@ -1,161 +1,1010 @@
 /** Copyright (C) 2021 by Christiaan de Leeuw (CTG Lab, Vrije Universiteit Amsterdam), All Rights Reserved **/
 
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "correlations.h"
+#include "kernels.h"
 
-CorrelationMatrix::CorrelationMatrix(vector<MatrixRow>& input, vector<double>& input_means, int offset, bool trim) : block_offset(offset) {
-  rows.swap(input); means.swap(input_means);
-  init();
-  
-  if (trim) {
-    int trim_index = -1;
-    for (int i = 0; i < rows.size(); i++) {
-      if (rows[i].length() > i) {
-        trim_index = i;
-        rows[i].begin = rows[i].end - i;
-      }
+namespace ldblock {
+
+void BandIndex::build(const vector<MatrixRow>& rows, int precision) {
+  clear();
+  size = rows.size();
+  for (int i = 0; i < size; i++) depth = max(depth, rows[i].count);
+  sums.assign((long long) size*(depth+1), 0);
+
+  vector<float> values(depth+1);
+  for (int b = 0; b < size; b++) {
+    const MatrixRow& row = rows[b]; int first = b - row.count;
+    if (row.count != min(b, depth)) error("correlation matrix does not have the expected band structure");
+    BandPrecision::decode(precision, row.begin, row.count, &values[0]);
+
+    double prefix = 0;
+    for (int a = first; a < b; a++) {
+      prefix += values[a-first];
+      double* diag = &sums[(long long) a*(depth+1)];
+      diag[b-a] = diag[b-a-1] + prefix;
     }
-    max_depth = rows.back().length();
-    compute_metric(0, trim_index+1);
+  }
+  for (int x = max(size-depth, 0); x < size; x++) {
+    double* diag = &sums[(long long) x*(depth+1)];
+    for (int d = size-x; d <= depth; d++) diag[d] = diag[d-1];
   }
 }
 
-CorrelationMatrix::CorrelationMatrix(vector<MatrixRow>& input, int offset) : rows(input), block_offset(offset) {init();}
+namespace {
+  // round to nearest even, values below the smallest subnormal become zero
+  inline unsigned short float_to_half(float value) {
+    unsigned int bits; memcpy(&bits, &value, sizeof(float));
+    unsigned int sign = (bits >> 16) & 0x8000, mant = bits & 0x7FFFFF, half, rem, mid;
+    int exp = int((bits >> 23) & 0xFF) - 127 + 15;
 
-void CorrelationMatrix::init() {
-  if (block_offset < 0) error("invalid offset for CorrelationMatrix object");
-  if (rows.empty()) error("input for CorrelationMatrix object is empty");
-  
-  max_depth = rows.back().length();
-  if (means.empty()) compute_metric();
+    if (exp >= 31) return sign | 0x7C00;
+    if (exp <= 0) {
+      if (exp < -10) return sign;
+      int shift = 14 - exp; mant |= 0x800000;
+      half = mant >> shift; rem = mant & ((1u << shift) - 1); mid = 1u << (shift - 1);
+    } else {
+      half = (exp << 10) | (mant >> 13); rem = mant & 0x1FFF; mid = 0x1000;
+    }
+    if (rem > mid || (rem == mid && (half & 1))) half++;
+    return sign | half;
+  }
+
+  inline float half_to_float(unsigned short half) {
+    unsigned int exp = (half >> 10) & 0x1F, mant = half & 0x3FF, bits;
+    if (exp == 0) {float value = mant * (1.0f / 16777216); return (half & 0x8000) ? -value : value;}
+    
+    if (exp == 31) bits = 0x7F800000 | (mant << 13);
+    else bits = ((exp - 15 + 127) << 23) | (mant << 13);
+    bits |= (unsigned int) (half & 0x8000) << 16;
+    float value; memcpy(&value, &bits, sizeof(float));
+    return value;
+  }
+}
+
+const char* BandPrecision::name(int type) {
+  if (type == fixed16) return "16-bit fixed point";
+  if (type == half16) return "half precision";
+  return "float";
 }
 
-double CorrelationMatrix::block_mean(int row_index) {
-  double sum = 0; int count = 0;
-  int offset = row_index+1, stop = rows.size() - offset;
+void BandPrecision::encode(int type, const float* values, int count, char* target) {
+  if (type == float32) {memcpy(target, values, count*sizeof(float)); return;}
 
-  for (int r = 0; r < stop; r++) {
-    MatrixRow& curr = rows[offset+r]; int use = curr.length() - r;
-    if (use > 0) {
-      for (float *read = curr.begin, *end = curr.end - r; read < end; ++read) sum += *read;
-      count += use;
-    }
-    else break;
+  unsigned short* write = (unsigned short*) target;
+  if (type == fixed16) {for (int i = 0; i < count; i++) write[i] = (unsigned short) (min(max(values[i], 0.0f), 1.0f) * 65535 + 0.5f);}
+  else {for (int i = 0; i < count; i++) write[i] = float_to_half(values[i]);}
+}
+
+void BandPrecision::decode(int type, const char* source, int count, float* values) {
+  if (type == float32) {memcpy(values, source, count*sizeof(float)); return;}
+
+  const unsigned short* read = (const unsigned short*) source;
+  if (type == fixed16) {for (int i = 0; i < count; i++) values[i] = read[i] * (1.0f / 65535);}
+  else {for (int i = 0; i < count; i++) values[i] = half_to_float(read[i]);}
+}
+
+
+// entries left of begin only need to be subtracted when they can reach past index
+double BandIndex::cross_sum(int begin, int end, int index) {
+  double sum = value(index, end-1-index);
+  if (begin > 0 && index-begin+1 < depth) sum -= value(begin-1, end-begin) - value(begin-1, index-begin+1);
+  return sum;
+}
+
+// for row b the entries in the block are those with max(begin, b-depth) <= a <= index
+long long BandIndex::cross_count(int begin, int end, int index, int depth) {
+  long long last = min(end-1, index+depth), full = min(last, (long long) begin+depth);
+  long long count = max(full - index, 0LL) * (index - begin + 1);
+
+  long long from = max(index+1, begin+depth+1);
+  if (from <= last) count += (last - from + 1) * (index + depth + 1) - (from + last) * (last - from + 1) / 2;
+  return count;
+}
+
+
+// the sums are those of BandIndex for the whole matrix, so the metric is the same as with an index of the whole band
+CorrelationMatrix::CorrelationMatrix(const vector<double>& cross_sums, int depth, Correlations& source)
+    : band(0), size(source.get_size()), source(&source), window(0), data(0), window_from(0), window_to(0) {
+  if (size <= 0) error("input for CorrelationMatrix object is empty");
+  this->depth = min(depth, size-1);
+
+  means.resize(size-1);
+  for (int i = 0; i < size-1; i++) means[i] = cross_sums[i] / BandIndex::cross_count(0, size, i, this->depth);
+}
+
+CorrelationMatrix::CorrelationMatrix(const vector<double>& cross_sums, int depth, Correlations* window, GenoData& data, const vector<pair<int,int> >& positions)
+    : band(0), size(positions.size()), source(0), window(window), data(&data), positions(positions), window_from(0), window_to(0) {
+  if (size <= 0) error("input for CorrelationMatrix object is empty");
+  this->depth = min(depth, size-1);
+
+  means.resize(size-1);
+  for (int i = 0; i < size-1; i++) means[i] = cross_sums[i] / BandIndex::cross_count(0, size, i, this->depth);
+}
+
+CorrelationMatrix::CorrelationMatrix(const CorrelationMatrix& other)
+    : band(0), means(other.means), size(other.size), depth(other.depth), source(other.source), window(0), data(0), window_from(0), window_to(0) {}
+
+CorrelationMatrix::~CorrelationMatrix() {
+  delete window;
+}
+
+CorrelationMatrix* CorrelationMatrix::copy() {
+  if (!source) error("correlation matrix without a band cannot be shared");
+  return new CorrelationMatrix(*this);
+}
+
+// rows of the window trail at most depth SNPs, so the sums of BandIndex match those of the whole band for
+// splits with at least 2*depth SNPs of the window before them and depth after
+void CorrelationMatrix::load_window(int index) {
+  window_from = max(index - 3*depth + 1, 0); window_to = min(index + 3*depth + 1, size);
+  if (source) {
+    source->index_window(local, window_from, window_to);
+    band = &local;
+    return;
   }
-  return sum/count;
+
+  int loaded = window->compute_block(*data, positions[window_from].second, positions[window_to-1].second + 1);
+  if (loaded < window_to - window_from) error("recomputed correlations do not match the SNPs of the matrix");
+  band = &window->get_index();
 }
 
+double CorrelationMatrix::block_mean(int begin, int end, int index) {
+  if (!band || (window_from > 0 && index < window_from + 2*depth - 1) || (window_to < size && index + depth + 1 > window_to)) load_window(index);
+  return band->block_mean(max(begin - window_from, 0), min(end, window_to) - window_from, index - window_from);
+}
 
-void CorrelationMatrix::compute_metric(int from, int to) {
-  if (from < 0) from = 0;
-  if (to < 0 || to >= rows.size()) to = rows.size() - 1;
+CorrelationMatrix* Correlations::get_matrix() {
+  if (!band_free) {
+    band_sums();
+    return new CorrelationMatrix(cross_sums, depth, *this);
+  }
 
-  means.resize(rows.size()-1);
-  for (int i = from; i < to; i++) means[i] = block_mean(i);
+  Settings window_config = config; window_config.threads = 1; window_config.band_free = false;
+  return new CorrelationMatrix(cross_sums, depth, new Correlations(window_config), *source, positions);
 }
 
-CorrelationMatrix* CorrelationMatrix::split(int index) {
-  if (index < 0 || index >= (rows.size()-1)) error("invalid split index for correlation matrix");
-  
-  vector<MatrixRow> split_rows(rows.begin()+index+1, rows.end());
-  vector<double> split_means(means.begin()+index+1, means.end());
-  
-  rows.resize(index+1); 
-  compute_metric(index - max_depth + 1);
-  max_depth = rows.back().length();
+// the rows are cut to the SNPs of the window, as if the band started at its first SNP; spilled rows are dropped again once read
+void Correlations::index_window(BandIndex& target, int from, int to) {
+  vector<MatrixRow> window; int width = BandPrecision::bytes(precision);
+  for (int b = from; b < to; b++) {
+    int length = min(rows[b].count, b - from);
+    window.push_back(MatrixRow(rows[b].begin + (rows[b].count - length) * width, length));
+  }
+  target.build(window, precision);
+  for (int i = 0; i < storage.size() && is_spilled(); i++) storage[i]->evict(0, storage[i]->size());
+}
 
-  return new CorrelationMatrix(split_rows, split_means, block_offset+index+1, true);
+// prefix sums of each row are added to the SNPs it trails in the same order as BandIndex::build adds them;
+// when spilled, the rows are dropped from memory once read
+void Correlations::band_sums() {
+  cross_sums.assign(rows.size(), 0);
+  vector<float> values(depth+1); int src = 0;
+  for (int b = 0; b < rows.size(); b++) {
+    int length = rows[b].count, first = b - length;
+    BandPrecision::decode(precision, rows[b].begin, length, &values[0]);
+
+    double prefix = 0;
+    for (int a = first; a < b; a++) {
+      prefix += values[a-first];
+      cross_sums[a] += prefix;
+    }
+    while (src < storage.size() && !(rows[b].begin >= storage[src]->get_data() && rows[b].begin <= storage[src]->get_data() + storage[src]->size())) {
+      storage[src]->evict(0, storage[src]->size()); src++;
+    }
+  }
+  for (int i = 0; i < storage.size(); i++) storage[i]->evict(0, storage[i]->size());
 }
 
+Correlations::Correlations(Settings& settings) : depth(settings.snp_window), storage_size(10000), group_size(16), threads(settings.threads), prefetch(settings.prefetch), stall_time(0), decode_time(0), snps_read(0),
+    progress_log(0), progress_interval(0), progress(0), next_report(0), progress_total(0), packed(settings.packed), precision(settings.band_precision), band_free(settings.band_free), config(settings), mem_limit(settings.mem_limit * 1048576.0), tmp_dir(settings.tmp_dir), source(0), shard_from(0), shard_to(0), shard_context(0) {
+  if (band_free) precision = BandPrecision::float32;
+  kernel_level = settings.simd ? Kernels::detect_level() : Kernels::scalar;
+}
 
 void Correlations::compute(GenoData& data_src) {
+  compute_shard(data_src, 0, data_src.get_nsnps());
+}
+
+void Correlations::compute_shard(GenoData& data_src, int from, int to) {
+  if (packed) compute_ranges<PackedWord>(data_src, from, to);
+  else compute_ranges<float>(data_src, from, to);
+}
+
+int Correlations::compute_block(GenoData& data_src, int from, int to) {
+  if (packed) return compute_band<PackedWord>(data_src, from, to);
+  return compute_band<float>(data_src, from, to);
+}
+
+// with multiple threads, the chromosome is split into more ranges than threads to balance the load,
+// except for a .bed stream that is not kept in memory, which can only be read front to back
+template<typename T>
+void Correlations::compute_ranges(GenoData& data_src, int first, int last) {
   clear_storage();
-  DataIterator data(data_src, positions, depth);
+  long long estimate = (long long) (last - first) * depth * BandPrecision::bytes(precision);
+  spill_dir = mem_limit > 0 && estimate > mem_limit && !band_free ? tmp_dir : "";
+  data_src.set_evict(!spill_dir.empty());
 
-  storage.push_back(new Buffer<float>(depth*(depth+1)/2.0));
-  float *write = storage.back()->get_data(), *end = write + storage.back()->size();
-  int N = data_src.get_nrow(); 
-  while (float* lead = data.advance_lead()) {
-    if (end-write < depth) {
-      storage.push_back(new Buffer<float>(depth,storage_size));    
-      write = storage.back()->get_data(), end = write + depth*storage_size;
+  int no_snps = last - first, no_ranges = 1;
+  if (threads > 1 && !data_src.is_sequential()) no_ranges = max(1, min(4*threads, no_snps / (4*(depth+1))));
+
+  vector<SnpRange> ranges(no_ranges);
+  for (int i = 0; i < no_ranges; i++) {
+    ranges[i].from = first + (long long) no_snps * i / no_ranges;
+    ranges[i].to = first + (long long) no_snps * (i+1) / no_ranges;
+  }
+
+  progress = 0; progress_total = no_snps; progress_start = chrono::steady_clock::now(); next_report = progress_interval;
+  if (no_ranges > 1) {
+    atomic<int> next(0); vector<thread> workers; ThreadErrors errors;
+    for (int t = 0; t < min(threads, no_ranges); t++) workers.push_back(thread(&Correlations::range_worker<T>, this, &data_src, &ranges, &next, &errors));
+    for (int t = 0; t < workers.size(); t++) workers[t].join();
+    errors.rethrow();
+  } else compute_range<T>(data_src, ranges[0]);
+
+  stall_time = decode_time = 0; snps_read = 0;
+  for (int i = 0; i < no_ranges; i++) {
+    stall_time += ranges[i].stall_time; decode_time += ranges[i].decode_time; snps_read += ranges[i].snps_read;
+    storage.insert(storage.end(), ranges[i].storage.begin(), ranges[i].storage.end());
+    rows.insert(rows.end(), ranges[i].rows.begin(), ranges[i].rows.end());
+    if (band_free) add_range_sums(ranges[i]);
+    positions.insert(positions.end(), ranges[i].positions.begin(), ranges[i].positions.end());
+  }
+  shard_from = first; shard_to = last; shard_context = ranges[0].context;
+  if (band_free) source = &data_src;
+  else if (rows.size() != positions.size()) error("number of SNP positions does not match size of correlation matrix");
+}
+
+// the context SNPs of a range are the last SNPs of the ranges before it, their sums are completed in order of rows
+void Correlations::add_range_sums(SnpRange& range) {
+  int offset = positions.size() - range.context;
+  if (offset < 0) error("number of SNP positions does not match size of correlation matrix");
+  for (int a = 0; a < range.context; a++) {
+    for (int b = 0; b < depth; b++) cross_sums[offset + a] += range.head[a*depth + b];
+  }
+  cross_sums.insert(cross_sums.end(), range.sums.begin(), range.sums.end());
+}
+
+// prefix sums of each row are added to the SNPs it trails in the same order as BandIndex::build adds them
+void Correlations::add_sums(SnpRange& range, int first, int count, float** values) {
+  for (int l = 0; l < count; l++) {
+    int b = first + l, length = min(b, depth);
+    range.sums.push_back(0);
+
+    double prefix = 0;
+    for (int a = b - length; a < b; a++) {
+      prefix += values[l][a - (b - length)];
+      if (a >= range.context) range.sums[a - range.context] += prefix;
+      else range.head[a*depth + b - range.context] = prefix;
     }
+  }
+}
 
-    MatrixRow row(write,0);
-    while (float* trail = data.get_next()) {
-      float r = compute_correlation(lead, trail, N);
-      *(write++) = r*r;
+template<typename T>
+void Correlations::range_worker(GenoData* data_src, vector<SnpRange>* ranges, atomic<int>* next, ThreadErrors* errors) {
+  try {
+    for (int i = (*next)++; i < ranges->size(); i = (*next)++) compute_range<T>(*data_src, (*ranges)[i]);
+  } catch (...) {errors->store(); *next = ranges->size();}
+}
+
+// the iterator is in its own scope, so that its loader has stopped using the reader when the totals are taken
+template<typename T>
+void Correlations::compute_range(GenoData& data_src, SnpRange& range) {
+  GenoData::Reader reader(data_src); reader.set_level(kernel_level);
+  int start = range.from, context = 0;
+  while (start > 0 && context < depth) {if (reader.check_snp(--start)) context++;}
+  
+  int no_rows = 0;
+  {
+  DataIterator<T> data(reader, range.positions, depth, start, prefetch);
+  int done = range.from;
+
+  int width = BandPrecision::bytes(precision);
+  if (!band_free) range.storage.push_back(new SpillBuffer((long long) depth*width*min(storage_size, range.to - range.from), spill_dir));
+  char *write = band_free ? 0 : range.storage.back()->get_data(), *end = band_free ? 0 : write + range.storage.back()->size();
+  int N = data_src.get_nrow(), index = 0; //index of first lead of group in range.positions
+  vector<float*> targets(group_size); vector<float> scratch(precision != BandPrecision::float32 || band_free ? group_size*depth : 0);
+  range.context = context;
+  if (band_free) range.head.assign(context*depth, 0);
+  while (int count = data.advance(group_size)) {
+    int lead = data.get_lead(), skip = max(0, min(count, context - index)), stop = skip;
+    while (stop < count && range.positions[index+stop].second < range.to) stop++;
+
+    for (int l = skip; l < stop && band_free; l++) targets[l] = &scratch[l*depth];
+    for (int l = skip; l < stop && !band_free; l++) {
+      if (end-write < depth*width) {
+        range.storage.back()->evict(0, write - range.storage.back()->get_data());
+        range.storage.push_back(new SpillBuffer((long long) depth*width*storage_size, spill_dir));
+        write = range.storage.back()->get_data(), end = write + range.storage.back()->size();
+      }
+      int length = min(index+l, depth);
+      range.rows.push_back(MatrixRow(write, length)); write += length*width;
+      targets[l] = precision == BandPrecision::float32 ? (float*) range.rows.back().begin : &scratch[l*depth];
+    }
+    if (stop > skip) {
+      compute_rows(data.get_snps(), lead+skip, stop-skip, &targets[skip], N, range.tile);
+      if (band_free) add_sums(range, index+skip, stop-skip, &targets[skip]);
+      else store_rows(&range.rows[range.rows.size() - (stop-skip)], stop-skip, &targets[skip]);
+      no_rows += stop-skip;
     }
 
-    row.end = write; 
-    rows.push_back(row);      
+    index += count;
+    if (stop > skip) {report_progress(range.positions[index-count+stop-1].second + 1 - done); done = range.positions[index-count+stop-1].second + 1;}
+    if (stop < count) break;
   }
-  if (rows.size() != positions.size()) error("number of SNP positions does not match size of correlation matrix");
+  report_progress(range.to - done);
+
+  if (!band_free) range.storage.back()->evict(0, write - range.storage.back()->get_data());
+  range.stall_time = data.get_stall_time();
+  }
+  range.decode_time = reader.get_decode_time(); range.snps_read = reader.get_snps_read();
+  range.positions.resize(context + no_rows);
+  range.positions.erase(range.positions.begin(), range.positions.begin() + context);
 }
 
-int Correlations::compute_block(GenoData& data_src, int from, int to) {
-  clear_storage();
+template<typename T>
+int Correlations::compute_band(GenoData& data_src, int from, int to) {
+  clear_storage(); spill_dir = "";
   
-  Buffer<float> data;
-  pair<int,int> loaded = data_src.load_data(data, positions, from, to-from);
-  storage.push_back(new Buffer<float>(depth*loaded.first));
+  GenoData::Reader reader(data_src); reader.set_level(kernel_level);
+  Buffer<T> data;
+  pair<int,int> loaded = reader.load_data(data, positions, from, to-from);
+  int width = BandPrecision::bytes(precision);
+  storage.push_back(new SpillBuffer((long long) depth*width*loaded.first));
   
-  float *write = storage.back()->get_data(); 
+  vector<T*> snps(loaded.first);
+  for (int i = 0; i < loaded.first; i++) snps[i] = data.get_column(i);
+
+  char *write = storage.back()->get_data(); 
   int N = data_src.get_nrow();   
-  for (int lead = 0; lead < loaded.first; lead++) {
-    MatrixRow row(write,0);
-    for (int trail = max(lead-depth,0); trail < lead; trail++) {
-      float r = compute_correlation(data.get_column(lead), data.get_column(trail), N);
-      *(write++) = r*r;      
+  vector<float*> targets(group_size); vector<double> tile; vector<float> scratch(precision != BandPrecision::float32 ? group_size*depth : 0);
+  for (int lead = 0; lead < loaded.first; lead += group_size) {
+    int count = min(group_size, loaded.first - lead);
+    for (int l = 0; l < count; l++) {
+      int length = min(lead+l, depth);
+      rows.push_back(MatrixRow(write, length)); write += length*width;
+      targets[l] = precision == BandPrecision::float32 ? (float*) rows.back().begin : &scratch[l*depth];
     }
-    row.end = write; 
-    rows.push_back(row);      
+    compute_rows(&snps[0], lead, count, &targets[0], N, tile);
+    store_rows(&rows[rows.size() - count], count, &targets[0]);
   }
   if (rows.size() != positions.size()) error("number of SNP positions does not match size of correlation matrix");
   return rows.size();
 }
 
+// rows in compact precision are computed as float first, and encoded here
+void Correlations::store_rows(MatrixRow* target, int count, float** values) {
+  if (precision == BandPrecision::float32) return;
+  for (int i = 0; i < count; i++) BandPrecision::encode(precision, values[i], target[i].length(), target[i].begin);
+}
+
+// the first thread to pass the time of the next report prints it
+void Correlations::report_progress(long long done) {
+  long long total = progress += done;
+  if (!progress_log || progress_interval <= 0) return;
+
+  double elapsed = chrono::duration<double>(chrono::steady_clock::now() - progress_start).count();
+  if (elapsed < next_report || total >= progress_total) return;
+  lock_guard<mutex> guard(progress_lock);
+  if (elapsed < next_report) return;
+  next_report = elapsed + progress_interval;
+
+  double rate = total / elapsed;
+  *progress_log << "\tprocessed " << total << " of " << progress_total << " SNPs (" << int(rate) << " SNPs/s, about " << ceil((progress_total - total) / max(rate, 1e-9)) << "s remaining)" << endl;
+}
+
+long long Correlations::get_pairs() {
+  long long total = 0;
+  for (int i = 0; i < rows.size(); i++) total += rows[i].length();
+  return total;
+}
+
+long long Correlations::get_band_bytes() {
+  long long total = 0;
+  for (int i = 0; i < rows.size(); i++) total += rows[i].length();
+  return total * BandPrecision::bytes(precision);
+}
+
+// the window index spans 6 * depth SNPs, see CorrelationMatrix::load_window
+long long Correlations::get_split_bytes() {
+  long long window = min(6LL * depth, (long long) get_size());
+  return ((long long) get_size() + window * (depth+1)) * sizeof(double);
+}
+
+void Correlations::convert(int new_precision) {
+  if (new_precision == precision) return;
+
+  long long total = 0; int width = BandPrecision::bytes(new_precision);
+  for (int i = 0; i < rows.size(); i++) total += rows[i].length();
+  SpillBuffer* converted = new SpillBuffer(total*width, spill_dir);
+
+  char* write = converted->get_data(); vector<float> values(depth+1);
+  for (int i = 0; i < rows.size(); i++) {
+    BandPrecision::decode(precision, rows[i].begin, rows[i].length(), &values[0]);
+    BandPrecision::encode(new_precision, &values[0], rows[i].length(), write);
+    rows[i].begin = write; write += rows[i].length()*width;
+  }
+
+  for (int i = 0; i < storage.size(); i++) delete storage[i];
+  for (int i = 0; i < caches.size(); i++) munmap(caches[i].first, caches[i].second);
+  storage.assign(1, converted); caches.clear();
+  band.clear(); precision = new_precision;
+}
+
+template<typename T>
+void Correlations::compute_rows(T** snps, int lead, int count, float** target, int n) {
+  for (int l = lead; l < lead+count; l++) {
+    float* write = target[l-lead];
+    for (int trail = max(l-depth,0); trail < l; trail++) {
+      float r = compute_correlation(snps[l], snps[trail], n);
+      *(write++) = r*r;
+    }
+  }
+}
+
+// computes the group of leads against all their trailing SNPs as one tile, discarding the pairs outside the band
+void Correlations::compute_rows(float** snps, int lead, int count, float** target, int n, vector<double>& tile) {
+  if (kernel_level == Kernels::scalar) {compute_rows<float>(snps, lead, count, target, n); return;}
+
+  int first = max(lead-depth, 0), width = lead+count-1 - first;
+  if (width <= 0) return;
+  if (tile.size() < count*width) tile.resize(count*width);
+
+  Kernels::dot_tile(kernel_level, snps+lead, count, snps+first, width, n, &tile[0]);
+  for (int l = 0; l < count; l++) {
+    float* write = target[l]; double* read = &tile[l*width];
+    for (int trail = max(lead+l-depth,0); trail < lead+l; trail++) {
+      float r = read[trail-first] / (n-1);
+      *(write++) = r*r;
+    }
+  }
+}
+
 double Correlations::compute_correlation(float* v1, float* v2, int n) {
   double sum = 0; float* end = v1 + n;
   while (v1 < end) sum += *(v1++) * *(v2++);
   return sum / (n-1);
 }
 
+// exact cross-products from the bitplanes; missing genotypes are set to the mean, as for standardized values
+double Correlations::compute_correlation(PackedWord* s1, PackedWord* s2, int n) {
+  PackedStats st1, st2; int words = (n + 63) / 64;
+  memcpy(&st1, s1, sizeof(PackedStats)); memcpy(&st2, s2, sizeof(PackedStats));
+  
+  PackedWord *ge1 = s1 + GenoData::packed_header, *eq1 = ge1 + words, *valid1 = eq1 + words;
+  PackedWord *ge2 = s2 + GenoData::packed_header, *eq2 = ge2 + words, *valid2 = eq2 + words;
+
+  long prod = 0, sum1 = st1.sum, sum2 = st2.sum, count = n;
+  for (int w = 0; w < words; w++) {
+    prod += __builtin_popcountll(ge1[w] & ge2[w]) + __builtin_popcountll(ge1[w] & eq2[w])
+      + __builtin_popcountll(eq1[w] & ge2[w]) + __builtin_popcountll(eq1[w] & eq2[w]);
+  }
+  if (st1.count < n || st2.count < n) {
+    sum1 = sum2 = count = 0;
+    for (int w = 0; w < words; w++) {
+      sum1 += __builtin_popcountll(ge1[w] & valid2[w]) + __builtin_popcountll(eq1[w] & valid2[w]);
+      sum2 += __builtin_popcountll(ge2[w] & valid1[w]) + __builtin_popcountll(eq2[w] & valid1[w]);
+      count += __builtin_popcountll(valid1[w] & valid2[w]);
+    }
+  }
+
+  double m1 = st1.mean, m2 = st2.mean;
+  double cov = prod - m2*sum1 - m1*sum2 + count*m1*m2;
+  return cov / ((double) st1.sd * st2.sd * (n-1));
+}
+
 void Correlations::clear_storage() {
   for (int i = 0; i < storage.size(); i++) delete storage[i];
-  storage.clear(); positions.clear(); rows.clear();
+  storage.clear(); positions.clear(); rows.clear(); cross_sums.clear(); source = 0;
+  band.clear(); shard_from = shard_to = shard_context = 0;
+  for (int i = 0; i < caches.size(); i++) munmap(caches[i].first, caches[i].second);
+  caches.clear();
+}
+
+
+// checksums are computed per row, so saving and loading see the same chunks
+namespace {
+  const char band_magic[8] = {'L','D','B','A','N','D','\0','\0'};
+
+  unsigned long long checksum(const char* data, unsigned long long size, unsigned long long hash = 14695981039346656037ULL) {
+    unsigned long long word, words = size / 8;
+    for (unsigned long long i = 0; i < words; i++) {memcpy(&word, data + 8*i, 8); hash = (hash ^ word) * 1099511628211ULL;}
+    for (unsigned long long i = 8*words; i < size; i++) hash = (hash ^ (unsigned char) data[i]) * 1099511628211ULL;
+    return hash;
+  }
+}
+
+void Correlations::save_band(const string& fname, GenoData& data_src) {
+  BandHeader header; memset(&header, 0, sizeof(BandHeader));
+  memcpy(header.magic, band_magic, 8); header.version = BandHeader::current_version;
+  header.window = depth; header.maf_thresh = data_src.get_thresh();
+  header.no_indiv = data_src.get_nrow(); header.no_snps = data_src.get_nsnps();
+  header.size = rows.size(); header.precision = precision; header.fingerprint = data_src.get_fingerprint();
+  header.shard_from = shard_from; header.shard_to = shard_to; header.context = shard_context;
+  int width = BandPrecision::bytes(precision);
+  
+  const char* pos_data = positions.empty() ? 0 : (const char*) &positions[0];
+  header.checksum = checksum(pos_data, positions.size() * sizeof(pair<int,int>));
+  for (int i = 0; i < rows.size(); i++) {
+    header.no_values += rows[i].length();
+    header.checksum = checksum(rows[i].begin, rows[i].length() * width, header.checksum);
+  }
+  
+  ofstream out(fname.c_str(), ios::binary);
+  out.write((const char*) &header, sizeof(BandHeader));
+  out.write(pos_data, positions.size() * sizeof(pair<int,int>));
+  for (int i = 0; i < rows.size(); i++) out.write(rows[i].begin, rows[i].length() * width);
+  if (!out.good()) error(string("unable to write band cache file '") + fname + "'");
+}
+
+// rows point directly into a private mapping of the file, and are appended to the targets
+BandHeader Correlations::map_band(const string& fname, GenoData& data_src, vector<MatrixRow>& target_rows, vector<pair<int,int> >& target_pos) {
+  int fd = open(fname.c_str(), O_RDONLY); struct stat status;
+  if (fd < 0 || fstat(fd, &status) != 0) error(string("unable to open band cache file '") + fname + "'");
+  unsigned long long cache_size = status.st_size;
+  void* mapped = cache_size >= sizeof(BandHeader) ? mmap(0, cache_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (mapped == MAP_FAILED) error(string("file '") + fname + "' is not a valid band cache file");
+  char* cache_map = (char*) mapped;
+  caches.push_back(make_pair(cache_map, cache_size));
+
+  BandHeader header; memcpy(&header, cache_map, sizeof(BandHeader));
+  if (memcmp(header.magic, band_magic, 8) != 0) error(string("file '") + fname + "' is not a valid band cache file");
+  if (header.version != BandHeader::current_version) error(string("band cache file '") + fname + "' has unsupported version " + DataUtils::to_string(header.version));
+  if (header.window != depth) error(string("band cache file '") + fname + "' was computed with window " + DataUtils::to_string(header.window));
+  if (header.maf_thresh != data_src.get_thresh()) error(string("band cache file '") + fname + "' was computed with MAF threshold " + DataUtils::to_string(header.maf_thresh));
+  if (header.no_indiv != data_src.get_nrow() || header.no_snps != data_src.get_nsnps() || header.fingerprint != data_src.get_fingerprint()) error(string("band cache file '") + fname + "' was computed for different input data");
+
+  if (header.precision < BandPrecision::float32 || header.precision > BandPrecision::half16) error(string("band cache file '") + fname + "' has unknown storage precision");
+  if (header.shard_from < 0 || header.shard_from > header.shard_to || header.shard_to > header.no_snps || header.context < 0 || header.context > depth) error(string("band cache file '") + fname + "' has an invalid SNP range");
+  int width = BandPrecision::bytes(header.precision);
+
+  unsigned long long pos_bytes = (unsigned long long) header.size * sizeof(pair<int,int>);
+  if (header.size < 0 || cache_size != sizeof(BandHeader) + pos_bytes + header.no_values * width) error(string("band cache file '") + fname + "' is truncated or corrupted");
+
+  const int* pos_read = (const int*) (cache_map + sizeof(BandHeader));
+  int offset = target_pos.size();
+  for (int i = 0; i < header.size; i++) target_pos.push_back(make_pair(pos_read[2*i], pos_read[2*i+1]));
+  char* read = cache_map + sizeof(BandHeader) + pos_bytes;
+  for (int i = 0; i < header.size; i++) {
+    int length = min(header.context + i, depth);
+    target_rows.push_back(MatrixRow(read, length)); read += length * width;
+  }
+  if (read != cache_map + cache_size) error(string("band cache file '") + fname + "' does not have the expected band structure");
+  for (int i = offset; i < target_pos.size(); i++) {
+    if (target_pos[i].second < header.shard_from || target_pos[i].second >= header.shard_to) error(string("band cache file '") + fname + "' has SNPs outside of its range");
+  }
+
+  unsigned long long sum = checksum(cache_map + sizeof(BandHeader), pos_bytes);
+  for (int i = target_rows.size() - header.size; i < target_rows.size(); i++) sum = checksum(target_rows[i].begin, target_rows[i].length() * width, sum);
+  if (sum != header.checksum) error(string("checksum of band cache file '") + fname + "' does not match");
+  return header;
+}
+
+void Correlations::load_band(const string& fname, GenoData& data_src) {
+  clear_storage();
+  BandHeader header = map_band(fname, data_src, rows, positions);
+  if (header.shard_from != 0 || header.shard_to != header.no_snps) error(string("band cache file '") + fname + "' is a shard of the band, use -merge to combine it with the other shards");
+
+  precision = header.precision; shard_to = header.no_snps;
+  spill_dir = ""; //rows stay in the mapped file
+}
+
+// shards are put in order of their ranges, which have to follow on each other, and each has to trail
+// the same context SNPs as the rows before it in a whole band
+void Correlations::merge_shards(const vector<string>& fnames, GenoData& data_src) {
+  clear_storage();
+  if (fnames.empty()) error("no band shards to merge");
+
+  vector<vector<MatrixRow> > shard_rows(fnames.size()); vector<vector<pair<int,int> > > shard_pos(fnames.size());
+  vector<pair<pair<int,int>, int> > order; vector<BandHeader> headers;
+  for (int i = 0; i < fnames.size(); i++) {
+    headers.push_back(map_band(fnames[i], data_src, shard_rows[i], shard_pos[i]));
+    if (headers[i].precision != headers[0].precision) error(string("band shard '") + fnames[i] + "' has a different storage precision than '" + fnames[0] + "'");
+    order.push_back(make_pair(make_pair(headers[i].shard_from, headers[i].shard_to), i));
+  }
+  sort(order.begin(), order.end());
+
+  int next = 0;
+  for (int k = 0; k < order.size(); k++) {
+    int i = order[k].second; const string& fname = fnames[i];
+    if (headers[i].shard_from > next) error("band shards do not cover SNPs " + DataUtils::to_string(next) + " to " + DataUtils::to_string(headers[i].shard_from - 1));
+    if (headers[i].shard_from < next) error(string("band shard '") + fname + "' overlaps with band shard '" + fnames[order[k-1].second] + "'");
+    if (headers[i].context != min((int) positions.size(), depth)) error(string("band shard '") + fname + "' does not have the expected trailing context");
+
+    rows.insert(rows.end(), shard_rows[i].begin(), shard_rows[i].end());
+    positions.insert(positions.end(), shard_pos[i].begin(), shard_pos[i].end());
+    next = headers[i].shard_to;
+  }
+  if (next < data_src.get_nsnps()) error("band shards do not cover SNPs " + DataUtils::to_string(next) + " to " + DataUtils::to_string(data_src.get_nsnps() - 1));
+
+  precision = headers[0].precision; shard_to = next;
+  spill_dir = ""; //rows stay in the mapped files
 }
 
 
-float* Correlations::DataIterator::advance_lead() {
-  if (!data.first) {    
-    data.first = new Buffer<float>();
-    data.second = new Buffer<float>();    
+// rows are packed again for the SNPs of the window before each range; the counts are taken in a first pass, as they determine
+// where the triples of each row go, and the window if it is not given
+PairStats::PairStats(GenoData& data_src, int stats_window, int threads, int cover, float maf_floor) : window(stats_window), no_indiv(data_src.get_nrow()), no_common(-1), mapped(0), mapped_size(0) {
+  set_layout(data_src);
+  data_src.set_retain(true); //a streamed .bed is read twice
+
+  int size = snps.size();
+  own_counts.resize(4LL*size);
+  for (int pass = 0; pass < 2; pass++) {
+    if (pass == 1) {
+      if (window <= 0) window = cover_window(cover, maf_floor);
+      use_storage(); set_offsets();
+      own_prods.resize(get_pairs()); own_triples.resize(3*get_triples());
+    }
+    int no_ranges = 1;
+    if (threads > 1) no_ranges = max(1, min(4*threads, size / (4*(max(window, 0)+1))));
+    vector<pair<int,int> > ranges;
+    for (int i = 0; i < no_ranges; i++) ranges.push_back(make_pair((long long) size * i / no_ranges, (long long) size * (i+1) / no_ranges));
+
+    atomic<int> next(0); ThreadErrors errors;
+    if (no_ranges > 1) {
+      vector<thread> workers;
+      for (int t = 0; t < min(threads, no_ranges); t++) workers.push_back(thread(&PairStats::rows_worker, this, &data_src, &ranges, pass == 0, &next, &errors));
+      for (int t = 0; t < workers.size(); t++) workers[t].join();
+    } else rows_worker(&data_src, &ranges, pass == 0, &next, &errors);
+    errors.rethrow();
+  }
+  use_storage();
+}
+
+// the SNPs at or above the floor in this batch stand in for those retained in the combined panel, so the window reaches back
+// from every SNP to the cover-th such SNP before it; the error in Correlations::compute_stats catches what this misses
+int PairStats::cover_window(int cover, float maf_floor) {
+  vector<int> common; int result = 1;
+  for (int i = 0; i < snps.size(); i++) {
+    const int* c = &own_counts[4LL*i];
+    int called = c[1] + c[2] + c[3]; float freq = called > 0 ? (c[2] + 2.0f*c[3]) / (2.0f*called) : 0;
+    if (cover > 0 && common.size() >= cover) result = max(result, i - common[common.size() - cover]);
+    else result = max(result, i);
+    if (called > 0 && min(freq, 1-freq) >= maf_floor && min(freq, 1-freq) > 0) common.push_back(i);
+  }
+  no_common = common.size();
+  return result;
+}
+
+void PairStats::rows_worker(GenoData* data_src, vector<pair<int,int> >* ranges, bool count, atomic<int>* next, ThreadErrors* errors) {
+  try {
+    for (int i = (*next)++; i < ranges->size(); i = (*next)++) {
+      if (count) count_rows(data_src, (*ranges)[i].first, (*ranges)[i].second);
+      else compute_rows(data_src, (*ranges)[i].first, (*ranges)[i].second);
+    }
+  } catch (...) {errors->store(); *next = ranges->size();}
+}
+
+void PairStats::count_rows(GenoData* data_src, int from, int to) {
+  GenoData::Reader reader(*data_src);
+  for (int i = from; i < to; i++) reader.count_snp(snps[i], &own_counts[4LL*i]);
+}
+
+// the sums are taken from the bitplanes as in Correlations::compute_correlation, the last window+1 SNPs are kept in a ring
+void PairStats::compute_rows(GenoData* data_src, int from, int to) {
+  GenoData::Reader reader(*data_src);
+  int words = (no_indiv + 63) / 64, slots = window+1;
+  vector<PackedWord> ring((long long) slots * 3*words);
+
+  for (int i = max(from - window, 0); i < to; i++) {
+    PackedWord *ge1 = &ring[(long long) (i % slots) * 3*words], *eq1 = ge1 + words, *valid1 = eq1 + words;
+    reader.pack_snp(snps[i], ge1);
+    if (i < from) continue;
+
+    unsigned int *prod = own_prods.data() + row_offset(i), *triple = own_triples.data() + 3*triple_offsets[i];
+    bool missing = counts[4*i] > 0;
+    for (int j = i - min(i, window); j < i; j++) {
+      PackedWord *ge2 = &ring[(long long) (j % slots) * 3*words], *eq2 = ge2 + words, *valid2 = eq2 + words;
+      unsigned int sum = 0;
+      for (int w = 0; w < words; w++) {
+        sum += __builtin_popcountll(ge1[w] & ge2[w]) + __builtin_popcountll(ge1[w] & eq2[w])
+          + __builtin_popcountll(eq1[w] & ge2[w]) + __builtin_popcountll(eq1[w] & eq2[w]);
+      }
+      *(prod++) = sum;
+
+      if (!missing && counts[4*j] == 0) continue;
+      unsigned int sum1 = 0, sum2 = 0, count = 0;
+      for (int w = 0; w < words; w++) {
+        sum1 += __builtin_popcountll(ge1[w] & valid2[w]) + __builtin_popcountll(eq1[w] & valid2[w]);
+        sum2 += __builtin_popcountll(ge2[w] & valid1[w]) + __builtin_popcountll(eq2[w] & valid1[w]);
+        count += __builtin_popcountll(valid1[w] & valid2[w]);
+      }
+      *(triple++) = sum1; *(triple++) = sum2; *(triple++) = count;
+    }
+  }
+}
+
+namespace {
+  const char stats_magic[8] = {'L','D','S','T','A','T','S','\0'};
+}
+
+// the file is mapped privately, like a band cache file
+PairStats::PairStats(const string& fname, GenoData& data_src) : window(0), no_indiv(0), no_common(-1), mapped(0), mapped_size(0) {
+  set_layout(data_src);
+
+  int fd = open(fname.c_str(), O_RDONLY); struct stat status;
+  if (fd < 0 || fstat(fd, &status) != 0) error(string("unable to open pair statistics file '") + fname + "'");
+  mapped_size = status.st_size;
+  void* map = mapped_size >= sizeof(StatsHeader) ? mmap(0, mapped_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (map == MAP_FAILED) error(string("file '") + fname + "' is not a valid pair statistics file");
+  mapped = (char*) map;
+
+  StatsHeader header; memcpy(&header, mapped, sizeof(StatsHeader));
+  if (memcmp(header.magic, stats_magic, 8) != 0) error(string("file '") + fname + "' is not a valid pair statistics file");
+  if (header.version != StatsHeader::current_version) error(string("pair statistics file '") + fname + "' has unsupported version " + DataUtils::to_string(header.version));
+  if (header.no_snps != data_src.get_nsnps() || header.no_valid != snps.size() || header.layout != layout) error(string("pair statistics file '") + fname + "' was computed for different SNPs");
+  if (header.window < 1 || header.no_indiv < 2) error(string("pair statistics file '") + fname + "' is truncated or corrupted");
+  window = header.window; no_indiv = header.no_indiv;
+
+  unsigned long long count_bytes = 4ULL*snps.size()*sizeof(int), prod_bytes = header.no_pairs*sizeof(unsigned int);
+  if (header.no_pairs != get_pairs() || header.no_triples < 0 || mapped_size != sizeof(StatsHeader) + count_bytes + prod_bytes + 3*header.no_triples*sizeof(unsigned int)) error(string("pair statistics file '") + fname + "' is truncated or corrupted");
+  unsigned long long triple_bytes = 3*header.no_triples*sizeof(unsigned int), hash = checksum(mapped + sizeof(StatsHeader), count_bytes); //in parts as in save
+  hash = checksum(mapped + sizeof(StatsHeader) + count_bytes, prod_bytes, hash);
+  if (checksum(mapped + sizeof(StatsHeader) + count_bytes + prod_bytes, triple_bytes, hash) != header.checksum) error(string("checksum of pair statistics file '") + fname + "' does not match");
+
+  counts = (const int*) (mapped + sizeof(StatsHeader));
+  prods = (const unsigned int*) (mapped + sizeof(StatsHeader) + count_bytes);
+  triples = prods + header.no_pairs;
+  set_offsets();
+  if (get_triples() != header.no_triples) error(string("pair statistics file '") + fname + "' is truncated or corrupted");
+}
+
+// pairs without a triple in a batch add that batch's SNP sums and size, see get_sums; batches with a larger window than the
+// merged one have their rows cut to it
+PairStats::PairStats(const vector<PairStats*>& batches) : window(0), no_indiv(0), no_snps(0), no_common(-1), layout(0), mapped(0), mapped_size(0) {
+  if (batches.empty()) error("no pair statistics to merge");
+  PairStats& first = *batches[0];
+  window = first.window; no_snps = first.no_snps; snps = first.snps; layout = first.layout;
+  for (int b = 0; b < batches.size(); b++) {
+    if (batches[b]->layout != layout) error("pair statistics to merge were computed for different SNPs");
+    window = min(window, batches[b]->window);
+    no_indiv += batches[b]->no_indiv;
+  }
+
+  int size = snps.size();
+  own_counts.assign(4LL*size, 0); own_prods.assign(get_pairs(), 0);
+  for (int b = 0; b < batches.size(); b++) {
+    PairStats& batch = *batches[b];
+    for (long long k = 0; k < own_counts.size(); k++) own_counts[k] += batch.counts[k];
+    if (batch.window == window) {
+      for (long long k = 0; k < own_prods.size(); k++) own_prods[k] += batch.prods[k];
+      continue;
+    }
+    for (int i = 0; i < size; i++) {
+      int length = min(i, window);
+      unsigned int* target = &own_prods[row_offset(i)];
+      const unsigned int* source = batch.prods + batch.row_offset(i) + min(i, batch.window) - length;
+      for (int k = 0; k < length; k++) target[k] += source[k];
+    }
+  }
+  use_storage(); set_offsets();
+
+  own_triples.resize(3*get_triples());
+  unsigned int* triple = own_triples.data();
+  for (int i = 0; i < size; i++) {
+    for (int j = i - min(i, window); j < i; j++) {
+      if (counts[4*i] == 0 && counts[4*j] == 0) continue;
+      long long total[3] = {0,0,0}, sums[4];
+      for (int b = 0; b < batches.size(); b++) {
+        batches[b]->get_sums(i, j, sums);
+        for (int k = 0; k < 3; k++) total[k] += sums[k+1];
+      }
+      for (int k = 0; k < 3; k++) *(triple++) = total[k];
+    }
+  }
+  use_storage();
+}
+
+PairStats::~PairStats() {
+  if (mapped) munmap(mapped, mapped_size);
+}
+
+void PairStats::set_layout(GenoData& data_src) {
+  no_snps = data_src.get_nsnps();
+  vector<int> positions(no_snps);
+  for (int i = 0; i < no_snps; i++) {
+    positions[i] = data_src.get_position(i);
+    if (positions[i] > 0) snps.push_back(i);
+  }
+  layout = checksum(no_snps > 0 ? (const char*) &positions[0] : 0, no_snps * sizeof(int));
+}
+
+// a row has a triple for every pair if its own SNP has missing genotypes, otherwise only for the pairs with such a SNP
+void PairStats::set_offsets() {
+  int size = snps.size();
+  missing_before.assign(size+1, 0); triple_offsets.assign(size+1, 0);
+  for (int i = 0; i < size; i++) missing_before[i+1] = missing_before[i] + (counts[4*i] > 0);
+  for (int i = 0; i < size; i++) {
+    int first = i - min(i, window);
+    triple_offsets[i+1] = triple_offsets[i] + (counts[4*i] > 0 ? i - first : missing_before[i] - missing_before[first]);
+  }
+}
+
+void PairStats::get_sums(int i, int j, long long sums[4]) {
+  int first = i - min(i, window);
+  const int *ci = counts + 4*i, *cj = counts + 4*j;
+  sums[0] = prods[row_offset(i) + j - first];
+  if (ci[0] == 0 && cj[0] == 0) {sums[1] = ci[2] + 2*ci[3]; sums[2] = cj[2] + 2*cj[3]; sums[3] = no_indiv; return;}
+
+  const unsigned int* triple = triples + 3*(triple_offsets[i] + (ci[0] > 0 ? j - first : missing_before[j] - missing_before[first]));
+  sums[1] = triple[0]; sums[2] = triple[1]; sums[3] = triple[2];
+}
+
+void PairStats::save(const string& fname) {
+  StatsHeader header; memset(&header, 0, sizeof(StatsHeader));
+  memcpy(header.magic, stats_magic, 8); header.version = StatsHeader::current_version;
+  header.window = window; header.no_indiv = no_indiv; header.no_snps = no_snps; header.no_valid = snps.size();
+  header.no_pairs = get_pairs(); header.no_triples = get_triples(); header.layout = layout;
+
+  unsigned long long count_bytes = 4ULL*snps.size()*sizeof(int), prod_bytes = header.no_pairs*sizeof(unsigned int), triple_bytes = 3*header.no_triples*sizeof(unsigned int);
+  header.checksum = checksum((const char*) counts, count_bytes);
+  header.checksum = checksum((const char*) prods, prod_bytes, header.checksum);
+  header.checksum = checksum((const char*) triples, triple_bytes, header.checksum);
+
+  ofstream out(fname.c_str(), ios::binary);
+  out.write((const char*) &header, sizeof(StatsHeader));
+  out.write((const char*) counts, count_bytes); out.write((const char*) prods, prod_bytes); out.write((const char*) triples, triple_bytes);
+  if (!out.good()) error(string("unable to write pair statistics file '") + fname + "'");
+}
+
+// SNPs are filtered on the counts of the whole panel, and each pair of the band is computed as for bit-packed genotypes
+void Correlations::compute_stats(PairStats& stats, GenoData& data_src) {
+  clear_storage();
+  if (stats.get_nindiv() != data_src.get_nrow()) error("pair statistics are for " + DataUtils::to_string(stats.get_nindiv()) + " individuals, but the input data has " + DataUtils::to_string(data_src.get_nrow()));
+
+  vector<int> retained; vector<PackedStats> moments;
+  for (int i = 0; i < stats.get_size(); i++) {
+    int counts[4]; memcpy(counts, stats.get_counts(i), sizeof(counts));
+    PackedStats snp;
+    if (!data_src.snp_stats(counts, snp.mean, snp.sd)) continue;
+    retained.push_back(i); moments.push_back(snp);
+    positions.push_back(make_pair(data_src.get_position(stats.get_snp(i)), stats.get_snp(i)));
+  }
+
+  int needed = 0;
+  for (int r = 1; r < retained.size(); r++) needed = max(needed, retained[r] - retained[r - min(r, depth)]);
+  if (needed > stats.get_window()) error("window of the pair statistics (" + DataUtils::to_string(stats.get_window()) + " SNPs) does not cover the band after filtering, compute them with '-stats-win " + DataUtils::to_string(needed) + "' or larger");
+
+  long long total = 0; int width = BandPrecision::bytes(precision);
+  for (int r = 0; r < retained.size(); r++) total += min(r, depth);
+  spill_dir = mem_limit > 0 && total * width > mem_limit ? tmp_dir : "";
+  storage.push_back(new SpillBuffer(max(total, 1LL) * width, spill_dir));
+  char* write = storage.back()->get_data();
+  for (int r = 0; r < retained.size(); r++) {rows.push_back(MatrixRow(write, min(r, depth))); write += min(r, depth) * width;}
+
+  atomic<int> next(0); ThreadErrors errors;
+  if (threads > 1) {
+    vector<thread> workers;
+    for (int t = 0; t < threads; t++) workers.push_back(thread(&Correlations::stats_worker, this, &stats, &retained, &moments, data_src.get_nrow(), &next, &errors));
+    for (int t = 0; t < workers.size(); t++) workers[t].join();
+  } else stats_worker(&stats, &retained, &moments, data_src.get_nrow(), &next, &errors);
+  errors.rethrow();
+  shard_to = data_src.get_nsnps();
+}
+
+void Correlations::stats_worker(PairStats* stats, vector<int>* retained, vector<PackedStats>* moments, int n, atomic<int>* next, ThreadErrors* errors) {
+  try {
+    vector<float> values(depth);
+    for (int from = (*next)++ * storage_size; from < rows.size(); from = (*next)++ * storage_size) {
+      for (int b = from; b < min(from + storage_size, (int) rows.size()); b++) {
+        int first = b - rows[b].length(), i = (*retained)[b];
+        for (int a = first; a < b; a++) {
+          long long sums[4]; stats->get_sums(i, (*retained)[a], sums);
+          double m1 = (*moments)[b].mean, m2 = (*moments)[a].mean;
+          double cov = sums[0] - m2*sums[1] - m1*sums[2] + sums[3]*m1*m2;
+          float r = cov / ((double) (*moments)[b].sd * (*moments)[a].sd * (n-1));
+          values[a-first] = r*r;
+        }
+        BandPrecision::encode(precision, &values[0], rows[b].length(), rows[b].begin);
+      }
+    }
+  } catch (...) {errors->store(); *next = rows.size() / storage_size + 1;}
+}
+
+
+template<typename T>
+Correlations::DataIterator<T>::DataIterator(GenoData::Reader& gd, vector<pair<int,int> >& pos, int size, int start, int queue) : data_src(gd), block_size(size+1), queue_size(max(queue,0)), curr_block(-1), loaded(0), released(0), offset(start), stop(false), stall_time(0), positions(pos) {
+  positions.clear();
+  for (int i = 0; i < queue_size+2; i++) slots.push_back(new Slot());
+}
+
+template<typename T>
+Correlations::DataIterator<T>::~DataIterator() {
+  if (loader.joinable()) {
+    {lock_guard<mutex> guard(lock); stop = true;}
+    changed.notify_all();
+    loader.join();
+  }
+  for (int i = 0; i < slots.size(); i++) delete slots[i];
+}
+
+template<typename T>
+bool Correlations::DataIterator<T>::load_block(Slot& slot) {
+  slot.positions.clear();
+  pair<int,int> count = data_src.load_data(slot.data, slot.positions, offset, block_size); offset += count.second;
+  return count.first > 0;
+}
+
+// background loading stops after the first empty block, which marks the end of the data
+template<typename T>
+void Correlations::DataIterator<T>::load_loop() {
+  for (long long block = 0; ; block++) {
+    {
+      unique_lock<mutex> guard(lock);
+      while (!stop && block >= released + (long long) slots.size()) changed.wait(guard);
+      if (stop) return;
+    }
+    bool more = false;
+    try {more = load_block(*slots[block % slots.size()]);}
+    catch (...) {lock_guard<mutex> guard(lock); load_error = current_exception();}
+    {lock_guard<mutex> guard(lock); loaded = block+1;}
+    changed.notify_all();
+    if (!more) return;
+  }
+}
+
+template<typename T>
+typename Correlations::DataIterator<T>::Slot& Correlations::DataIterator<T>::get_block(long long block) {
+  Slot& slot = *slots[block % slots.size()];
+  if (queue_size > 0) {
+    unique_lock<mutex> guard(lock);
+    if (loaded <= block) {
+      chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+      while (loaded <= block) changed.wait(guard);
+      stall_time += chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+    }
+    if (load_error) rethrow_exception(load_error);
+  } else {
+    chrono::steady_clock::time_point begin = chrono::steady_clock::now();
+    load_block(slot);
+    stall_time += chrono::duration<double>(chrono::steady_clock::now() - begin).count();
+  }
+  return slot;
+}
+
+// fills the half of snps starting at index with the SNPs of the block, and frees the slots before the previous block
+template<typename T>
+void Correlations::DataIterator<T>::use_block(long long block, int index) {
+  Slot& slot = get_block(block);
+  int count = slot.positions.size();
+  positions.insert(positions.end(), slot.positions.begin(), slot.positions.end());
+  for (int i = 0; i < block_size; i++) snps[index+i] = (i < count) ? slot.data.get_column(i) : 0;
+
+  if (queue_size > 0) {
+    {lock_guard<mutex> guard(lock); released = max(block - 1, 0LL);}
+    changed.notify_all();
+  }
+}
+
+template<typename T>
+int Correlations::DataIterator<T>::advance(int max_leads) {
+  if (curr_block < 0) {    
+    if (queue_size > 0) loader = thread(&DataIterator<T>::load_loop, this);
     snps.assign(2*block_size, 0);
-    
-    pair<int,int> loaded = data_src.load_data(*data.first, positions, 0, block_size); offset = loaded.second;
-    for (int i = 0; i < loaded.first; i++) snps[i] = data.first->get_column(i);
-    
-    loaded = data_src.load_data(*data.second, positions, offset, block_size); offset += loaded.second;
-    for (int i = 0; i < loaded.first; i++) snps[block_size+i] = data.second->get_column(i);
-    curr_lead = 0;
+    use_block(0, 0); use_block(1, block_size);
+    curr_block = 1; curr_lead = curr_count = 0;
   } else {
-    curr_lead++; 
+    curr_lead += curr_count; 
     if (curr_lead >= 2*block_size) {
       for (int i = 0; i < block_size; i++) snps[i] = snps[block_size+i];
-      swap(data.first, data.second);
-
-      pair<int,int> loaded = data_src.load_data(*data.second, positions, offset, block_size); offset += loaded.second;
-      for (int i = 0; i < block_size; i++) snps[block_size+i] = (i < loaded.first) ? data.second->get_column(i) : 0;
-      
+      use_block(++curr_block, block_size);
       curr_lead = block_size; 
     }
   } 
 
-  curr_trail = max(-1, curr_lead - block_size);   
-  return snps[curr_lead];
+  curr_count = 0;
+  while (curr_count < max_leads && curr_lead+curr_count < 2*block_size && snps[curr_lead+curr_count]) curr_count++;
+  return curr_count;
 }
 
-float* Correlations::DataIterator::get_next() {
-  curr_trail++; 
-  return curr_trail < curr_lead ? snps[curr_trail] : 0;
-}
+} // namespace ldblock
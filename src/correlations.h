@@ -4,85 +4,296 @@
 #define CORRELATIONS_H
 
 #include <utility>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <chrono>
 
 #include "data.h"                  
 
+namespace ldblock {
+
+// r-squared values of the band are stored as float, or in 16 bits as fixed point on [0,1] or as half precision float
+namespace BandPrecision {
+  enum Type {float32 = 0, fixed16 = 1, half16 = 2};
+
+  inline int bytes(int type) {return type == float32 ? sizeof(float) : sizeof(unsigned short);}
+  const char* name(int type);
+
+  void encode(int type, const float* values, int count, char* target);
+  void decode(int type, const char* source, int count, float* values);
+};
+
 struct MatrixRow {
-  float *begin, *end;
+  char* begin; int count; //values in the precision of the band
 
-  MatrixRow() : begin(0), end(0) {}
-  MatrixRow(float* begin, float* end) : begin(begin), end(end) {}
+  MatrixRow() : begin(0), count(0) {}
+  MatrixRow(char* begin, int count) : begin(begin), count(count) {}
 
-  int length() {return end-begin;}
-  float& value(int index) {return begin[index];}
+  int length() {return count;}
 };
 
+// cumulative sums of the band along its diagonals, so that the sum over any cross-block rectangle takes constant time
+// sums[x*(depth+1) + d] holds the sum of all entries (a,b) with a <= x < b <= x+d
 // for now, assuming regular matrix such that length of each row is either same as previous row or exactly one more
-// and hence also that max. length of rows equals length of last row
+class BandIndex {
+  int size, depth;
+  vector<double> sums;
+
+  double value(int x, int d) {return sums[(long long) x*(depth+1) + min(d, depth)];}
+
+public:
+  BandIndex() : size(0), depth(0) {}
+
+  void build(const vector<MatrixRow>& rows, int precision);
+  void clear() {sums.clear(); size = depth = 0;}
+
+  double cross_sum(int begin, int end, int index); //for block [begin,end) split right after index
+  long long cross_count(int begin, int end, int index) {return cross_count(begin, end, index, depth);}
+  static long long cross_count(int begin, int end, int index, int depth);
+  double block_mean(int begin, int end, int index) {return cross_sum(begin, end, index) / cross_count(begin, end, index);}
+
+  int get_size() {return size;}
+  int get_depth() {return depth;}
+};
+
+class Correlations;
+
+// the metric of the whole matrix comes from cross sums of the band, and block means are taken from an index over a window of
+// the band around the requested split; the window is indexed from the stored rows, or without a band from rows that are
+// recomputed from the genotype data
 class CorrelationMatrix {
-  vector<MatrixRow> rows;
+  BandIndex* band; BandIndex local; //index of the current window
   vector<double> means;
-  int block_offset, max_depth;
+  int size, depth;
+
+  Correlations* source; //rows of the whole band, if stored
+  Correlations* window; GenoData* data; //band-free only
+  vector<pair<int,int> > positions;
+  int window_from, window_to; //SNPs [from,to) of the current window
+
+  CorrelationMatrix(const CorrelationMatrix& other); //shares the band, with a window of its own
+  CorrelationMatrix& operator=(const CorrelationMatrix& other);
 
-  double block_mean(int row_index); // for split right after row_index
-  void compute_metric(int from=0, int to=-1);  
+  void load_window(int index); //window covering the block means Splitter requests for splits from index to index + 2*depth
 
-  void init();
-  CorrelationMatrix(vector<MatrixRow>& input, vector<double>& input_means, int offset, bool trim); 
 public:
-  CorrelationMatrix(vector<MatrixRow>& input, int offset); 
+  CorrelationMatrix(const vector<double>& cross_sums, int depth, Correlations& source); //source has to stay unchanged while in use
+  CorrelationMatrix(const vector<double>& cross_sums, int depth, Correlations* window, GenoData& data, const vector<pair<int,int> >& positions); //takes ownership of window
+  ~CorrelationMatrix();
 
-  int get_offset() {return block_offset;}
-  int get_size() {return rows.size();}
+  CorrelationMatrix* copy(); //for use by another thread, only with a stored band
+
+  int get_size() {return size;}
+  int get_depth() {return depth;}
   const vector<double>& get_metric() {return means;}
-  
-  CorrelationMatrix* split(int index); //split after SNP at index (NB: index range starts at 0, not at CM offset!)
+
+  double block_mean(int begin, int end, int index); //for block [begin,end) split right after index
 };
 
 
+// header of a band cache file, followed by the positions (pairs of int) and the rows of the band (floats) 
+struct BandHeader {
+  static const unsigned int current_version = 3;
+
+  char magic[8];
+  unsigned int version, window;
+  float maf_thresh; int no_indiv, no_snps; //settings and input the band was computed for
+  int size, precision; long long no_values; //precision as BandPrecision::Type
+  int shard_from, shard_to, context; //full data SNPs [from,to) of the rows, and SNPs before them that the first rows trail (0 for a whole band)
+  unsigned long long fingerprint, checksum; //of the input data, and of everything following the header
+};
+
+// header of a file of pair statistics, followed by the genotype counts of the SNPs (4 ints each), the product sums of the pairs
+// (unsigned int each) and their triples (3 unsigned ints each)
+struct StatsHeader {
+  static const unsigned int current_version = 1;
+
+  char magic[8];
+  unsigned int version, window;
+  int no_indiv, no_snps, no_valid; //individuals of the batch, SNPs in the data and those with a valid position
+  long long no_pairs, no_triples;
+  unsigned long long layout, checksum; //hash of the SNP positions, and of everything following the header
+};
+
+// additive sufficient statistics of the correlations over a batch of individuals, so that batches processed separately add up to
+// exactly the correlations of the combined panel; for every SNP with a valid position these are its genotype counts (missing, hom1,
+// het, hom2), and for each pair with one of the window SNPs before it the sum of genotype products over the individuals where both
+// are non-missing, plus a triple (sums of either SNP and number of individuals over those same individuals) if either SNP has
+// missing genotypes in the batch, as otherwise it follows from the genotype counts
+class PairStats {
+  int window, no_indiv, no_snps; //no_snps of the data, snps holds the data index of each SNP with a valid position
+  int no_common; //SNPs at or above the MAF floor the window was sized from, -1 for a given window
+  vector<int> snps;
+  unsigned long long layout;
+
+  vector<int> own_counts; vector<unsigned int> own_prods, own_triples; //storage unless mapped from a file
+  char* mapped; unsigned long long mapped_size;
+  const int* counts; const unsigned int *prods, *triples;
+  vector<long long> triple_offsets; //first triple of each row, and the total
+  vector<int> missing_before; //number of SNPs with missing genotypes before each SNP
+
+  PairStats(const PairStats& other);
+  PairStats& operator=(const PairStats& other);
+
+  void set_layout(GenoData& data_src);
+  void set_offsets(); //from the counts
+  int cover_window(int cover, float maf_floor); //from the counts
+  void use_storage() {counts = own_counts.empty() ? 0 : &own_counts[0]; prods = own_prods.empty() ? 0 : &own_prods[0]; triples = own_triples.empty() ? 0 : &own_triples[0];}
+  void count_rows(GenoData* data_src, int from, int to);
+  void compute_rows(GenoData* data_src, int from, int to);
+  void rows_worker(GenoData* data_src, vector<pair<int,int> >* ranges, bool count, atomic<int>* next, ThreadErrors* errors);
+
+public:
+  PairStats(GenoData& data_src, int window, int threads, int cover = 0, float maf_floor = 0); //computes the statistics of the individuals of data_src, window 0 to cover that many SNPs at or above maf_floor
+  PairStats(const string& fname, GenoData& data_src); //statistics of a batch with the same SNPs as data_src, mapped from file
+  PairStats(const vector<PairStats*>& batches); //sum of the batches, over the smallest of their windows
+  ~PairStats();
+
+  void save(const string& fname);
+
+  int get_window() {return window;}
+  int get_common() {return no_common;}
+  int get_nindiv() {return no_indiv;}
+  int get_size() {return snps.size();}
+  int get_snp(int i) {return snps[i];} //data index of SNP i
+  const int* get_counts(int i) {return counts + 4*i;}
+  long long get_pairs() {return row_offset(snps.size());}
+  long long get_triples() {return triple_offsets.back();}
+
+  long long row_offset(int i) {return i <= window ? (long long) i*(i-1)/2 : (long long) window*(window+1)/2 + (long long) (i-window-1)*window;} //first pair of row i
+  void get_sums(int i, int j, long long sums[4]); //product sum, sums of SNP i and j, and count for SNPs j < i, i-j <= window
+};
+
 class Correlations {
-  int depth, storage_size;
+  int depth, storage_size, group_size, threads, prefetch;
+  double stall_time, decode_time; long long snps_read; //totals over all threads for the last compute
+
+  ostream* progress_log; double progress_interval; //seconds between progress lines, none if 0
+  atomic<long long> progress; atomic<double> next_report; long long progress_total;
+  mutex progress_lock; chrono::steady_clock::time_point progress_start;
+  bool packed; //use bit-packed genotypes instead of standardized values
+  int kernel_level; //Kernels::Level used for standardized values
+  int precision; //BandPrecision::Type of the stored band
+  bool band_free; //compute only the cross sums of the metric, not the band
+  Settings config; //for the window computations of a band-free matrix
+  long long mem_limit; //bytes, the band is spilled to temporary files when it would not fit
+  string tmp_dir, spill_dir; //spill_dir is empty when not spilling
   
-  vector<Buffer<float>*> storage;
+  vector<SpillBuffer*> storage;
   vector<MatrixRow> rows;
   vector<pair<int,int> > positions; //base pair position, full data SNP index
+  BandIndex band;
+  vector<double> cross_sums; GenoData* source; //cross sums of all splits of the whole matrix, and for band-free the data they are for
+  int shard_from, shard_to, shard_context; //full data SNPs the rows cover, see BandHeader
+  vector<pair<char*, unsigned long long> > caches; //mapped band cache files the rows point into, if loaded
 
-  class DataIterator;
+  template<typename T> class DataIterator;
+  struct SnpRange;
 
   double compute_correlation(float* v1, float* v2, int n);
+  double compute_correlation(PackedWord* s1, PackedWord* s2, int n);
+  void store_rows(MatrixRow* target, int count, float** values);
+  void add_sums(SnpRange& range, int first, int count, float** values);
+  void add_range_sums(SnpRange& range);
+  void band_sums(); //cross sums of a stored band
+  template<typename T> void compute_rows(T** snps, int lead, int count, float** target, int n);
+  void compute_rows(float** snps, int lead, int count, float** target, int n, vector<double>& tile);
+  void compute_rows(PackedWord** snps, int lead, int count, float** target, int n, vector<double>&) {compute_rows<PackedWord>(snps, lead, count, target, n);} //tile is only used by the float kernels
+  template<typename T> void compute_range(GenoData& data_src, SnpRange& range);
+  template<typename T> void range_worker(GenoData* data_src, vector<SnpRange>* ranges, atomic<int>* next, ThreadErrors* errors);
+  template<typename T> void compute_ranges(GenoData& data_src, int first, int last);
+  template<typename T> int compute_band(GenoData& data_src, int from, int to);
+  void stats_worker(PairStats* stats, vector<int>* retained, vector<PackedStats>* moments, int n, atomic<int>* next, ThreadErrors* errors);
   void clear_storage();
+  BandHeader map_band(const string& fname, GenoData& data_src, vector<MatrixRow>& target_rows, vector<pair<int,int> >& target_pos);
+  void report_progress(long long done); //adds SNPs done, prints a progress line when due
   
 public:
-  Correlations(int snp_depth) : depth(snp_depth), storage_size(10000) {}
+  Correlations(Settings& settings);
   ~Correlations() {clear_storage();}
 
   void compute(GenoData& data_src);
+  void compute_shard(GenoData& data_src, int from, int to); //rows for full data SNPs [from,to) only, to be saved and merged later
   int compute_block(GenoData& data_src, int from, int to);  
+  void save_band(const string& fname, GenoData& data_src);
+  void load_band(const string& fname, GenoData& data_src); //rejects files computed with other settings or input data
+  void merge_shards(const vector<string>& fnames, GenoData& data_src); //shards must cover all SNPs without gaps or overlaps
+  void compute_stats(PairStats& stats, GenoData& data_src); //band from pair statistics for the individuals of data_src
+  void convert(int new_precision); //re-encodes the stored band
 
-  int get_size() {return rows.size();}
+  int get_size() {return positions.size();}
   int get_depth() {return depth;}
+  int get_kernel() {return kernel_level;}
+  int get_precision() {return precision;}
+  long long get_band_bytes(); //size of the stored band values
+  long long get_split_bytes(); //size of the cross sums and the window index used while splitting
+  bool is_spilled() {return !spill_dir.empty();}
+  bool is_band_free() {return band_free;}
+  double get_stall_time() {return stall_time;} //seconds the computation waited for genotype data in last compute
+  double get_decode_time() {return decode_time;} //seconds spent reading and standardizing genotypes, summed over threads
+  long long get_snps_read() {return snps_read;} //SNPs read from the .bed file, including those read again as context
+  long long get_pairs(); //number of r-squared values in the band
+  int get_chunks() {return storage.size();}
+  void set_progress(ostream* log, double interval) {progress_log = log; progress_interval = interval;}
   const vector<pair<int,int> >& get_positions() {return positions;} 
-  CorrelationMatrix* get_matrix() {return new CorrelationMatrix(rows, 0);}  
+  BandIndex& get_index() {band.build(rows, precision); return band;} //index is only valid until next compute
+  void index_window(BandIndex& target, int from, int to); //index of the band for SNPs [from,to) only
+  CorrelationMatrix* get_matrix(); //matrix is only valid until next compute
 };
 
+// rows of the band for SNPs with full data index in [from,to), computed with the preceding SNPs as trailing context
+struct Correlations::SnpRange {
+  int from, to;
+  vector<SpillBuffer*> storage;
+  vector<MatrixRow> rows;
+  vector<pair<int,int> > positions;
+  vector<double> tile;
+  double stall_time, decode_time; long long snps_read;
+
+  int context; vector<double> sums, head; //band-free: cross sums of the rows, and contributions to the context SNPs (context x depth)
+};
+
+// blocks of SNPs are loaded into a ring of slots, by a background thread when queue_size > 0
+// the current block of leads and the block before it are in use, and up to queue_size further blocks are loaded ahead
+template<typename T>
 class Correlations::DataIterator {
-  GenoData& data_src;
-  int block_size;
+  struct Slot {
+    Buffer<T> data;
+    vector<pair<int,int> > positions;
+  };
+
+  GenoData::Reader& data_src;
+  int block_size, queue_size;
   
-  pair<Buffer<float>*,Buffer<float>*> data;
-  vector<float*> snps;
-  vector<pair<int,int> >& positions;
-  int offset, curr_lead, curr_trail;
+  vector<Slot*> slots;
+  long long curr_block, loaded, released; //blocks are stored in slot (block % slots.size())
+  int offset; bool stop;
+  thread loader; mutex lock; condition_variable changed;
+  double stall_time; //seconds spent waiting for blocks
+  exception_ptr load_error; //thrown by the loader, rethrown when the next block is used
 
+  vector<T*> snps;
+  vector<pair<int,int> >& positions;
+  int curr_lead, curr_count;
 
+  bool load_block(Slot& slot);
+  void load_loop();
+  Slot& get_block(long long block);
+  void use_block(long long block, int index);
 
 public:
-  DataIterator(GenoData& gd, vector<pair<int,int> >& pos, int size) : data_src(gd), positions(pos), block_size(size+1), data(0,0) {positions.clear();}
-  ~DataIterator() {delete data.first; delete data.second;}
+  DataIterator(GenoData::Reader& gd, vector<pair<int,int> >& pos, int size, int start=0, int queue=0);
+  ~DataIterator();
 
-  float* advance_lead();
-  float* get_next();   
+  int advance(int max_leads); //moves to next group of consecutive leads, returns size of group (0 when done)
+  T** get_snps() {return &snps[0];} //trailing SNPs of lead at index i are at indices max(0,i-depth) to i-1
+  int get_lead() {return curr_lead;}
+  double get_stall_time() {return stall_time;}
 };
 
 
+} // namespace ldblock
+
 #endif /* CORRELATIONS_H */
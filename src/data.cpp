@@ -1,119 +1,718 @@
 /** Copyright (C) 2021 by Christiaan de Leeuw (CTG Lab, Vrije Universiteit Amsterdam), All Rights Reserved **/
 
 #include <cmath>
+#include <algorithm>
+#include <random>
+#include <cstdlib>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <chrono>
+#include <cerrno>
+#include <climits>
+#include <thread>
 
 #include "data.h"
+#include "kernels.h"
 
-GenoData::GenoData(const string& prefix, float maf_thresh) : prefix(prefix), maf_thresh(maf_thresh) {
+namespace ldblock {
+
+SpillBuffer::SpillBuffer(long long size, const string& dir, bool zero) : content(0), bytes(max(size, 0LL)), mapped(!dir.empty()) {
+  if (bytes == 0) {mapped = false; return;}
+  if (!mapped) {
+    content = zero ? new char[bytes]() : new char[bytes];
+    return;
+  }
+
+  string templ = dir + "/ldblock_spill_XXXXXX";
+  int fd = mkstemp(&templ[0]);
+  if (fd < 0) error(string("unable to create temporary file in directory '") + dir + "'");
+  unlink(templ.c_str());
+  
+  void* region = ftruncate(fd, bytes) == 0 ? mmap(0, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+  close(fd);
+  if (region == MAP_FAILED) error(string("unable to map temporary file in directory '") + dir + "'");
+  content = (char*) region;
+}
+
+SpillBuffer::~SpillBuffer() {
+  if (mapped) munmap(content, bytes);
+  else delete[] content;
+}
+
+void SpillBuffer::evict(long long from, long long to) {
+  static const long long page = sysconf(_SC_PAGESIZE);
+  from = (max(from, 0LL) + page - 1) / page * page; to = min(to, bytes) / page * page;
+  if (mapped && to > from) madvise(content + from, to - from, MADV_DONTNEED);
+}
+
+
+namespace {
+  const unsigned long long fnv_offset = 14695981039346656037ULL, fnv_prime = 1099511628211ULL;
+  const int hash_step = 1024; //every hash_step-th SNP is included in the fingerprint
+
+  unsigned long long hash_bytes(unsigned long long hash, const char* data, long long size) {
+    for (long long i = 0; i < size; i++) hash = (hash ^ (unsigned char) data[i]) * fnv_prime;
+    return hash;
+  }
+
+  // read-only mapping of a whole file, null for an empty file
+  const char* map_file(const string& fname, unsigned long long& size) {
+    int fd = open(fname.c_str(), O_RDONLY); struct stat status;
+    if (fd < 0 || fstat(fd, &status) != 0) error(string("unable to open file '") + fname + "'");
+    size = status.st_size;
+    void* mapped = size > 0 ? mmap(0, size, PROT_READ, MAP_PRIVATE, fd, 0) : 0;
+    close(fd);
+    if (mapped == MAP_FAILED) error(string("unable to map file '") + fname + "' into memory");
+    if (mapped) madvise(mapped, size, MADV_SEQUENTIAL);
+    return (const char*) mapped;
+  }
+
+  inline bool is_blank(char c) {return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';}
+
+  // as reading an int with an istream that has to be used up: an optional sign and only digits; 0 if it is not a positive int
+  int parse_position(const char* p, const char* end) {
+    if (p < end && *p == '+') p++;
+    if (p == end) return 0;
+    long long value = 0;
+    for (; p < end; p++) {
+      if (*p < '0' || *p > '9') return 0;
+      value = value*10 + (*p - '0');
+      if (value > INT_MAX) return 0;
+    }
+    return value;
+  }
+
+  const int index_step = 4096; //SNPs per chunk of a .bim index
+
+  // lines of a part of a .bim file; chromosome names are stored where they change, with the index of their first SNP
+  struct BimLines {
+    const char *begin, *end;
+    vector<int> position;
+    vector<pair<string,int> > chr_starts;
+    vector<pair<long long,int> > marks; //byte offset and SNP index of lines where a chunk of the index can start
+    int lines, bad_line; //lines parsed, and the first line with fewer than four values (-1 if none), where parsing stopped
+
+    BimLines(const char* begin, const char* end) : begin(begin), end(end), lines(0), bad_line(-1) {}
+  };
+
+  void parse_lines(BimLines* part) {
+    const char *p = part->begin, *end = part->end, *chr = 0; int chr_length = -1;
+    while (p < end) {
+      const char *line = p, *token[4], *token_end[4]; int count = 0;
+      while (count < 4) {
+        while (p < end && is_blank(*p)) p++;
+        if (p == end || *p == '\n') break;
+        token[count] = p;
+        while (p < end && *p != '\n' && !is_blank(*p)) p++;
+        token_end[count++] = p;
+      }
+      if (count < 4) {part->bad_line = part->lines; return;}
+
+      int index = part->position.size(), length = token_end[0] - token[0];
+      bool new_chr = length != chr_length || memcmp(chr, token[0], length) != 0;
+      if (new_chr) {part->chr_starts.push_back(pair<string,int>(string(token[0], length), index)); chr = token[0]; chr_length = length;}
+      if (new_chr || index % index_step == 0) part->marks.push_back(pair<long long,int>(line - part->begin, index));
+      part->position.push_back(parse_position(token[3], token_end[3]));
+
+      const char* next = (const char*) memchr(p, '\n', end - p);
+      p = next ? next + 1 : end;
+      part->lines++;
+    }
+  }
+
+  // large files are split at line ends into parts that are parsed in parallel
+  BimLines parse_bim(const char* begin, const char* end, int threads) {
+    const long long part_size = 1LL << 24;
+    int no_parts = max(1, (int) min((long long) threads, (end - begin) / part_size));
+
+    vector<BimLines> parts;
+    for (int i = 0; i < no_parts; i++) {
+      const char *from = i == 0 ? begin : parts.back().end, *to = end;
+      if (i < no_parts-1) {
+        const char* split = max(begin + (end - begin) / no_parts * (i+1), from);
+        const char* line_end = (const char*) memchr(split, '\n', end - split);
+        if (line_end) to = line_end + 1;
+      }
+      parts.push_back(BimLines(from, to));
+    }
+    if (no_parts > 1) {
+      vector<thread> workers;
+      for (int i = 0; i < no_parts; i++) workers.push_back(thread(parse_lines, &parts[i]));
+      for (int i = 0; i < no_parts; i++) workers[i].join();
+    } else parse_lines(&parts[0]);
+
+    BimLines result(begin, end);
+    for (int i = 0; i < no_parts; i++) {
+      BimLines& part = parts[i]; int offset = result.position.size();
+      result.position.insert(result.position.end(), part.position.begin(), part.position.end());
+      for (int c = 0; c < part.chr_starts.size(); c++) {
+        if (!result.chr_starts.empty() && c == 0 && result.chr_starts.back().first == part.chr_starts[c].first) continue;
+        result.chr_starts.push_back(pair<string,int>(part.chr_starts[c].first, offset + part.chr_starts[c].second));
+      }
+      for (int m = 0; m < part.marks.size(); m++) result.marks.push_back(pair<long long,int>(part.begin - begin + part.marks[m].first, offset + part.marks[m].second));
+      if (part.bad_line >= 0) {result.bad_line = result.lines + part.bad_line; break;}
+      result.lines += part.lines;
+    }
+    return result;
+  }
+
+  // sidecar index of a .bim file, for reading the lines of a region only; chunks do not span chromosomes
+  struct IndexHeader {
+    char magic[8];
+    unsigned int version;
+    int no_snps, no_chunks;
+    long long bim_size, bim_mtime; //of the .bim file the index is for
+  };
+
+  struct IndexChunk {
+    long long offset; //in the .bim file, of the line of first_snp
+    int first_snp, min_pos, max_pos; //positions over the SNPs with a valid position
+    char chr[32]; //chromosome name, truncated
+  };
+
+  const char index_magic[8] = {'L','D','B','I','M','I','D','X'};
+  const unsigned int index_version = 1;
+
+  // false if it cannot be written, for example in a read-only directory; the .bim file is then parsed in full next time as well
+  bool write_index(const string& fname, const BimLines& lines, const struct stat& bim_status) {
+    vector<IndexChunk> chunks; int chr = 0;
+    for (int m = 0; m < lines.marks.size(); m++) {
+      IndexChunk chunk; memset(&chunk, 0, sizeof(IndexChunk));
+      chunk.offset = lines.marks[m].first; chunk.first_snp = lines.marks[m].second; chunk.min_pos = INT_MAX; chunk.max_pos = 0;
+      while (chr+1 < lines.chr_starts.size() && lines.chr_starts[chr+1].second <= chunk.first_snp) chr++;
+      strncpy(chunk.chr, lines.chr_starts[chr].first.c_str(), sizeof(chunk.chr) - 1);
+
+      int last = m+1 < lines.marks.size() ? lines.marks[m+1].second : lines.position.size();
+      for (int i = chunk.first_snp; i < last; i++) {
+        if (lines.position[i] > 0) {chunk.min_pos = min(chunk.min_pos, lines.position[i]); chunk.max_pos = max(chunk.max_pos, lines.position[i]);}
+      }
+      chunks.push_back(chunk);
+    }
+
+    IndexHeader header; memset(&header, 0, sizeof(IndexHeader));
+    memcpy(header.magic, index_magic, 8); header.version = index_version;
+    header.no_snps = lines.position.size(); header.no_chunks = chunks.size();
+    header.bim_size = bim_status.st_size; header.bim_mtime = bim_status.st_mtime;
+
+    ofstream out(fname.c_str(), ios::binary);
+    out.write((const char*) &header, sizeof(IndexHeader));
+    if (!chunks.empty()) out.write((const char*) &chunks[0], chunks.size() * sizeof(IndexChunk));
+    if (out.good()) return true;
+    out.close(); unlink(fname.c_str());
+    return false;
+  }
+
+  // false at the end of the file
+  bool read_fully(int fd, char* target, long long size) {
+    while (size > 0) {
+      ssize_t count = read(fd, target, size);
+      if (count < 0 && errno == EINTR) continue;
+      if (count <= 0) return false;
+      target += count; size -= count;
+    }
+    return true;
+  }
+}
+
+BedStream::BedStream(int fd, long long snp_bytes, int no_snps, unsigned long long hash) : fd(fd), snp_bytes(snp_bytes), no_snps(no_snps), released(0), loaded(0), retain(false), hash(hash) {
+  chunk_snps = max(1LL, (1LL << 22) / max(snp_bytes, 1LL));
+  chunks.assign((no_snps + chunk_snps - 1) / chunk_snps, (char*) 0);
+}
+
+BedStream::~BedStream() {
+  for (int i = 0; i < chunks.size(); i++) delete[] chunks[i];
+  if (fd > 0) close(fd);
+}
+
+void BedStream::fetch(int count) {
+  lock_guard<mutex> guard(lock);
+  count = min(count, no_snps);
+  while (loaded < count) {
+    int index = loaded / chunk_snps, size = min(chunk_snps, no_snps - index*chunk_snps);
+    char* chunk = new char[size*snp_bytes];
+    if (!read_fully(fd, chunk, size*snp_bytes)) error("size of .bed file is inconsistent with number of SNPs and individuals in .bim and .fam files");
+    for (int i = (index*chunk_snps + hash_step - 1) / hash_step * hash_step; i < index*chunk_snps + size; i += hash_step) hash = hash_bytes(hash, chunk + (i - index*chunk_snps)*snp_bytes, snp_bytes);
+    chunks[index] = chunk; loaded += size;
+
+    char extra;
+    if (loaded == no_snps && read_fully(fd, &extra, 1)) error("size of .bed file is inconsistent with number of SNPs and individuals in .bim and .fam files");
+  }
+}
+
+void BedStream::release(int count) {
+  if (retain) return;
+  lock_guard<mutex> guard(lock);
+  for (; released < min(count, (int) loaded) / chunk_snps; released++) {delete[] chunks[released]; chunks[released] = 0;}
+}
+
+unsigned long long BedStream::get_hash() {
+  for (int i = loaded; i < no_snps; i = loaded) {fetch(i + chunk_snps); release(loaded);}
+  return hash;
+}
+
+
+GenoData::GenoData(const string& prefix, float maf_thresh, const string& bed_file, const Region& region, int threads, ostream& log, bool genotypes) : prefix(prefix), maf_thresh(maf_thresh), threads(threads), log(&log), owner(true), evict_read(false), bed_file(bed_file), stream(0), float_input(false), region(region), first_snp(0), file_snps(0), bim_time(0) {
   read_fam();  
   read_bim();
-  prep_bed();
+  if (genotypes) prep_bed();
+  else skip_bed();
+}
+
+// the caller owns the genotypes, so this object does not; there is no mapping to advise or release pages of
+GenoData::GenoData(const GenoInput& input, float maf_thresh) : prefix("<memory>"), maf_thresh(maf_thresh), threads(1), log(&cout), map_data(0), map_size(0), owner(false), evict_read(false), stream(0), float_input(input.values != 0), first_snp(0), file_snps(0), bim_time(0) {
+  if ((input.packed != 0) == (input.values != 0)) error("genotypes in memory should be given either packed or as float values");
+  if (input.no_indiv < 2) error("genotypes in memory should have at least two individuals");
+  if (input.chr.size() != input.position.size()) error("number of chromosome names does not match number of SNP positions");
+
+  no_indiv = input.no_indiv; no_snps = input.position.size();
+  no_words = (no_indiv + 63) / 64; packed_bytes = (no_indiv + 3) / 4;
+  block_count = float_input ? no_indiv * sizeof(float) : packed_bytes;
+  bed_data = float_input ? (const char*) input.values : input.packed;
+
+  for (int i = 0; i < no_snps; i++) {
+    if (segments.empty() || segments.back().chr != input.chr[i]) segments.push_back(Segment(input.chr[i], i));
+    segments.back().to = i+1;
+    position.push_back(max(input.position[i], 0));
+  }
+  set_bounds();
+}
+
+GenoData::GenoData(GenoData& source, const Segment& segment) : prefix(source.prefix + ":" + segment.chr), maf_thresh(source.maf_thresh), threads(source.threads), log(source.log), owner(false), evict_read(false), stream(0), float_input(source.float_input), first_snp(0), file_snps(0), bim_time(0) {
+  if (source.stream) error("chromosomes of a streamed .bed file cannot be analysed separately");
+  map_data = source.map_data; map_size = source.map_size; block_count = source.block_count;
+  bed_data = source.get_raw(segment.from);
+  no_words = source.no_words; packed_bytes = source.packed_bytes; sample = source.sample;
+
+  no_indiv = source.no_indiv; no_snps = segment.to - segment.from;
+  position.assign(source.position.begin() + segment.from, source.position.begin() + segment.to);
+  segments.push_back(Segment(segment.chr, 0)); segments.back().to = no_snps;
+  set_bounds();
+}
+
+// a stream is shared as well, the source must retain it if more than one view reads it
+GenoData::GenoData(GenoData& source, const string& name, const vector<int>& sample) : prefix(source.prefix + "[" + name + "]"), maf_thresh(source.maf_thresh), threads(source.threads), log(source.log), owner(false), evict_read(false), stream(source.stream), float_input(source.float_input), sample(sample), first_snp(0), file_snps(0), bim_time(0) {
+  map_data = source.map_data; map_size = source.map_size; block_count = source.block_count; bed_data = source.bed_data;
+  no_indiv = sample.size(); no_words = (no_indiv + 63) / 64; packed_bytes = (no_indiv + 3) / 4;
+
+  no_snps = source.no_snps; position = source.position; segments = source.segments;
+  set_bounds();
+}
+
+GenoData::~GenoData() {
+  if (!owner) return;
+  if (stream) delete stream;
+  else if (map_data) munmap((void*) map_data, map_size);
+}
+
+GenoData* GenoData::get_population(const string& name, const string& keep_file) {
+  if (!map_data && !stream) error("populations can only be selected from the .fam file of PLINK data");
+  string fname = prefix + ".fam", line, fid, iid;
+  ifstream fam(fname.c_str(), ifstream::in), keep(keep_file.c_str(), ifstream::in);
+  istringstream extract;
+
+  *log << "Reading " << keep_file << "... ";
+  vector<string> keep_ids;
+  while (getline(keep, line)) {
+    extract.clear(); extract.str(line);
+    if (extract >> fid >> iid) keep_ids.push_back(fid + " " + iid);
+  }
+  sort(keep_ids.begin(), keep_ids.end());
+
+  vector<int> selected;
+  for (int i = 0; getline(fam, line); i++) {
+    extract.clear(); extract.str(line);
+    if (extract >> fid >> iid && binary_search(keep_ids.begin(), keep_ids.end(), fid + " " + iid)) selected.push_back(i);
+  }
+  *log << "found " << selected.size() << " individuals in data for population '" << name << "' (out of " << keep_ids.size() << " listed)" << endl;
+  if (selected.size() < 2) error(string("fewer than two individuals of keep file '") + keep_file + "' are in the data");
+
+  return new GenoData(*this, name, selected);
+}
+
+GenoData* GenoData::get_subsample(int size, unsigned int seed) {
+  vector<int> selected = sample;
+  if (selected.empty()) for (int i = 0; i < no_indiv; i++) selected.push_back(i);
+
+  mt19937 generator(seed);
+  for (int i = 0; i < size && i < no_indiv - 1; i++) swap(selected[i], selected[i + generator() % (no_indiv - i)]);
+  selected.resize(min(size, no_indiv));
+  sort(selected.begin(), selected.end());
+
+  return new GenoData(*this, "subsample", selected);
 }
 
+// a last line without line end is counted as well
 void GenoData::read_fam() {
-  string fname = prefix + ".fam", line;
-  ifstream fam(fname.c_str(), ifstream::in);
+  string fname = prefix + ".fam";
+  *log << "Reading " << fname << "... ";
+  unsigned long long size; const char* fam = map_file(fname, size);
 
-  cout << "Reading " << fname << "... ";
   no_indiv = 0;
-  while (getline(fam, line)) no_indiv++;
-  cout << "found " << no_indiv << " individuals in data" << endl;
+  for (const char *p = fam, *end = fam + size; p < end; no_indiv++) {
+    const char* next = (const char*) memchr(p, '\n', end - p);
+    p = next ? next + 1 : end;
+  }
+  if (fam) munmap((void*) fam, size);
+  *log << "found " << no_indiv << " individuals in data" << endl;
 }
 
+// with a region, only the lines in it are kept; the index narrows down the part of the file to parse
 void GenoData::read_bim() {
-  string fname = prefix + ".bim", line, value;
-  ifstream bim(fname.c_str(), ifstream::in);
-  istringstream extract, convert;
+  string fname = prefix + ".bim", index_name = fname + ".idx";
+  *log << "Reading " << fname << "... ";
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
+  unsigned long long size; const char* bim = map_file(fname, size);
+  bool index_failed = false;
 
-  cout << "Reading " << fname << "... ";
-  int line_no = 0, valid = 0, pos;
-  while (getline(bim, line)) {
-    line_no++; extract.clear(); extract.str(line);  
-    for (int i = 0; i < 4; i++) {if (!(extract >> value)) error(string("not enough values on line ") + DataUtils::to_string(line_no));}
+  if (region.empty() || !region.use_index || !read_index(index_name, bim, size)) {
+    BimLines lines = parse_bim(bim, bim + size, threads);
+    if (lines.bad_line >= 0) {if (bim) munmap((void*) bim, size); error(string("not enough values on line ") + DataUtils::to_string(lines.bad_line + 1));}
+    if (region.use_index) {struct stat status; stat(fname.c_str(), &status); index_failed = !write_index(index_name, lines, status);}
 
-    convert.clear(); convert.str(value); convert >> pos;
-    if (convert.eof() && !convert.fail() && pos > 0) {position.push_back(pos); valid++;}
-    else position.push_back(0);
+    position.swap(lines.position); first_snp = 0; file_snps = position.size();
+    for (int c = 0; c < lines.chr_starts.size(); c++) {
+      if (!segments.empty()) segments.back().to = lines.chr_starts[c].second;
+      segments.push_back(Segment(lines.chr_starts[c].first, lines.chr_starts[c].second));
+    }
+    if (!segments.empty()) segments.back().to = position.size();
   }
+  if (bim) munmap((void*) bim, size);
+
+  if (!region.empty()) select_region();
   no_snps = position.size();
+  set_bounds();
+  bim_time = chrono::duration<double>(chrono::steady_clock::now() - start).count();
 
+  int valid = 0;
+  for (int i = 0; i < no_snps; i++) valid += position[i] > 0;
+  if (region.empty()) *log << "found " << valid << " SNPs (out of " << no_snps << ")" << endl;
+  else *log << "found " << valid << " SNPs in region " << region.name() << " (out of " << file_snps << ")" << endl;
+  if (index_failed) *log << "WARNING: unable to write index file '" << index_name << "', continuing without it" << endl;
+}
+
+// parses the chunks of the index from the first to the last one that can have SNPs in the region
+bool GenoData::read_index(const string& fname, const char* bim, unsigned long long bim_size) {
+  unsigned long long size; struct stat status;
+  if (stat(fname.c_str(), &status) != 0 || !S_ISREG(status.st_mode)) return false;
+  const char* index = map_file(fname, size);
+
+  IndexHeader header; memset(&header, 0, sizeof(IndexHeader));
+  if (size >= sizeof(IndexHeader)) memcpy(&header, index, sizeof(IndexHeader));
+  stat((prefix + ".bim").c_str(), &status);
+  bool valid = memcmp(header.magic, index_magic, 8) == 0 && header.version == index_version && header.bim_size == bim_size && header.bim_mtime == status.st_mtime
+    && header.no_chunks >= 0 && size == sizeof(IndexHeader) + header.no_chunks * sizeof(IndexChunk);
+
+  int first = -1, last = -1;
+  const IndexChunk* chunks = valid ? (const IndexChunk*) (index + sizeof(IndexHeader)) : 0;
+  for (int c = 0; valid && c < header.no_chunks; c++) {
+    if (strncmp(chunks[c].chr, region.chr.c_str(), sizeof(chunks[c].chr) - 1) != 0 || chunks[c].max_pos < region.from_bp || chunks[c].min_pos > region.to_bp) continue;
+    if (first < 0) first = c;
+    last = c;
+  }
+
+  if (first >= 0) {
+    long long from = chunks[first].offset, to = last+1 < header.no_chunks ? chunks[last+1].offset : bim_size;
+    BimLines lines = parse_bim(bim + from, bim + to, threads);
+    if (lines.bad_line >= 0) valid = false;
+    else {
+      position.swap(lines.position); first_snp = chunks[first].first_snp; file_snps = header.no_snps;
+      for (int c = 0; c < lines.chr_starts.size(); c++) {
+        if (!segments.empty()) segments.back().to = lines.chr_starts[c].second;
+        segments.push_back(Segment(lines.chr_starts[c].first, lines.chr_starts[c].second));
+      }
+      if (!segments.empty()) segments.back().to = position.size();
+    }
+  } else if (valid) file_snps = header.no_snps;
+  if (index) munmap((void*) index, size);
+  return valid;
+}
+
+// SNPs outside the region are skipped, and those before the first or after the last SNP in it are dropped
+void GenoData::select_region() {
+  int first = -1, last = -1;
+  for (int s = 0; s < segments.size(); s++) {
+    bool selected = segments[s].chr == region.chr;
+    for (int i = segments[s].from; i < segments[s].to; i++) {
+      if (!selected || position[i] < region.from_bp || position[i] > region.to_bp) position[i] = 0;
+      else if (position[i] > 0) {if (first < 0) first = i; last = i;}
+    }
+  }
+  if (first < 0) error(string("no SNPs found in region ") + region.name());
+
+  position.erase(position.begin() + last + 1, position.end());
+  position.erase(position.begin(), position.begin() + first);
+  first_snp += first;
+  segments.assign(1, Segment(region.chr, 0)); segments.back().to = position.size();
+}
+
+void GenoData::set_bounds() {
   pos_bounds.first = 0; pos_bounds.second = 0;
   for (int i = 0; i < no_snps && (pos_bounds.first == 0); i++) {if (position[i] > 0) pos_bounds.first = position[i];}
   for (int i = no_snps-1; i >= 0 && (pos_bounds.second == 0); i--) {if (position[i] > 0) pos_bounds.second = position[i];}  
-  
-  cout << "found " << valid << " SNPs (out of " << no_snps << ")" << endl;
 }
 
+// a .bed file that is not a regular file is read as a stream
 void GenoData::prep_bed() {
-  string fname = prefix + ".bed";
-  cout << "Preparing file " << fname << "..." << endl;
+  string fname = bed_file.empty() ? prefix + ".bed" : bed_file;
+  *log << "Preparing file " << (fname == "-" ? "<standard input>" : fname) << "..." << endl;
 
   block_count = (unsigned long long) ceil(no_indiv/4.0);
-  bed_file.open(fname.c_str(), ios::in|ios::binary|ios::ate);
-  unsigned long bed_size = bed_file.tellg(), exp_bed_size = block_count * no_snps + 3; ///for SNP-major format
-
-  char buffer[3];
-  bed_file.seekg(0, ios::beg); bed_file.read(buffer, 3);
-  if (bed_file.fail() || ((unsigned short) buffer[0] != 108 || (unsigned short) buffer[1] != 27)) error("file is not a valid .bed file");
-  if ((unsigned short) buffer[2] != 1) {
-    if (buffer[2] == 0) error("file is in individual-major format");
+  no_words = (no_indiv + 63) / 64; packed_bytes = block_count;
+  int fd = fname == "-" ? 0 : open(fname.c_str(), O_RDONLY); struct stat status;
+  if (fd < 0 || fstat(fd, &status) != 0) error(string("unable to open file '") + fname + "'");
+  unsigned long long exp_bed_size = block_count * file_snps + 3; ///for SNP-major format
+
+  char header[3];
+  if (S_ISREG(status.st_mode)) {
+    map_size = status.st_size;
+    void* mapped = map_size > 0 ? mmap(0, map_size, PROT_READ, MAP_SHARED, fd, 0) : MAP_FAILED;
+    if (fd > 0) close(fd);
+    if (mapped == MAP_FAILED) error(string("unable to map file '") + fname + "' into memory");
+    map_data = (const char*) mapped; bed_data = map_data + 3 + block_count * first_snp;
+    madvise(mapped, map_size, MADV_SEQUENTIAL);
+    memcpy(header, map_data, min(map_size, 3ULL));
+  } else {
+    if (!region.empty()) error("a region can only be selected from a .bed file that is a regular file");
+    map_data = bed_data = 0; map_size = exp_bed_size;
+    if (!read_fully(fd, header, 3)) map_size = 0;
+    stream = new BedStream(fd, block_count, no_snps, hash_positions());
+  }
+
+  if (map_size < 3 || ((unsigned short) header[0] != 108 || (unsigned short) header[1] != 27)) error("file is not a valid .bed file");
+  if ((unsigned short) header[2] != 1) {
+    if (header[2] == 0) error("file is in individual-major format");
     else error("file-format specifier is not valid");    
   }
-  if (bed_size != exp_bed_size) error("size of .bed file is inconsistent with number of SNPs and individuals in .bim and .fam files");
+  if (map_size != exp_bed_size) error("size of .bed file is inconsistent with number of SNPs and individuals in .bim and .fam files");
+}
+
+void GenoData::skip_bed() {
+  block_count = (no_indiv + 3) / 4;
+  no_words = (no_indiv + 63) / 64; packed_bytes = block_count;
+  map_data = bed_data = 0; map_size = 0;
+}
+
+bool GenoData::snp_stats(int counts[4], float& mean, float& sd) {
+  float sum = 0, sq = 0, nonzero = 0;
+  for (int i = 1; i < 4; i++) {sum += (i-1)*counts[i]; sq += (i-1)*(i-1)*counts[i]; nonzero += (counts[i] != 0);}
+  mean = sum / no_indiv; float freq = sum / (2*(no_indiv - counts[0]));
+
+  sq += counts[0]*mean*mean;
+  sd = (sq - mean*sum) / (no_indiv-1); sd = sd > 0 ? sqrt(sd) : 0;
+
+  return !(nonzero < 2 || min(freq, 1-freq) < maf_thresh || sd <= 0);
+}
+
+// low bit of a code is set for missing and hom2, high bit for het and hom2; padding after the last individual is masked
+void GenoData::count_genotypes(const char* raw, int counts[4]) {
+  const unsigned long long low_bits = 0x5555555555555555ULL;
+  int bytes = packed_bytes, pop[3] = {0,0,0}; //low only, high only, both
+
+  for (int start = 0; start < bytes; start += 8) {
+    unsigned long long word = 0; int size = min(8, bytes - start);
+    memcpy(&word, raw + start, size);
+    if (start + size == bytes && no_indiv % 4) word &= (1ULL << (8*(size-1) + 2*(no_indiv % 4))) - 1;
 
-           
-  unsigned char value_index[] = {1,0,2,3}; //hom1, miss, het, hom2
-  for (int i = 0; i < 256; i++) {
-    for (int j = 0; j < 4; j++) geno_index[i][j] = value_index[(i >> (2*j)) & 3];
+    unsigned long long low = word & low_bits, high = (word >> 1) & low_bits;
+    pop[0] += __builtin_popcountll(low & ~high); pop[1] += __builtin_popcountll(high & ~low); pop[2] += __builtin_popcountll(low & high);
   }
-  
-  raw_buffer.resize(block_count, 1);
-  geno_buffer.resize(no_indiv, 1); 
+  counts[0] = pop[0]; counts[2] = pop[1]; counts[3] = pop[2];
+  counts[1] = no_indiv - pop[0] - pop[1] - pop[2];
+}
+
+unsigned long long GenoData::hash_positions() {
+  unsigned long long hash = fnv_offset;
+  hash = (hash ^ no_indiv) * fnv_prime; hash = (hash ^ no_snps) * fnv_prime;
+  for (int i = 0; i < no_snps; i++) hash = (hash ^ position[i]) * fnv_prime;
+  return hash;
+}
+
+// a stream adds the sampled SNPs to the hash as it reads them
+unsigned long long GenoData::get_fingerprint() {
+  unsigned long long hash = stream ? stream->get_hash() : hash_positions();
+  for (int i = 0; i < no_snps && bed_data; i += hash_step) hash = hash_bytes(hash, get_raw(i), block_count);
+  for (int i = 0; i < sample.size(); i++) hash = (hash ^ sample[i]) * fnv_prime;
+  return hash;
+}
+
+void GenoData::advise(int index, int count) {
+  if (stream || !map_data) return;
+  static const unsigned long long page = sysconf(_SC_PAGESIZE);
+  unsigned long long from = (get_raw(index) - map_data) / page * page, to = get_raw(min(index+count, no_snps)) - map_data;
+  if (to > from) madvise((void*) (map_data + from), to - from, MADV_WILLNEED);
 }
 
-pair<int,int> GenoData::load_block(float* target, vector<pair<int,int> >& pos_target, int offset, int total) {
-  if (offset < 0 || offset >= no_snps) return pair<int,int>(0,0);
+
+void GenoData::release(int index, int count) {
+  if (stream) {stream->release(index + count); return;}
+  if (!map_data) return;
+  static const unsigned long long page = sysconf(_SC_PAGESIZE);
+  unsigned long long from = (get_raw(index) - map_data + page - 1) / page * page, to = (get_raw(min(index+count, no_snps)) - map_data) / page * page;
+  if (to > from) madvise((void*) (map_data + from), to - from, MADV_DONTNEED);
+}
+
+
+GenoData::Reader::Reader(GenoData& data) : data(data), level(Kernels::detect_level()), snps_read(0), decode_time(0) {
+  if (!data.bed_data && !data.stream) error("genotypes of '" + data.prefix + "' were not read");
+  if (!data.sample.empty() || data.float_input) sample_buffer.resize(data.packed_bytes, 1);
+}
+
+// gathers the codes of the selected individuals into the same layout as a full SNP; float values are encoded the same way
+const char* GenoData::Reader::get_snp(int index) {
+  const char* raw = data.get_raw(index);
+  if (data.float_input) return encode_values((const float*) raw);
+  if (data.sample.empty()) return raw;
+
+  // each target byte is assembled from four codes at once, and copied whole when they are an aligned run of the source
+  unsigned char* target = (unsigned char*) sample_buffer.get_data();
+  const unsigned char* source = (const unsigned char*) raw;
+  const int* sample = &data.sample[0];
+  int full = data.no_indiv / 4;
+  for (int b = 0; b < full; b++, sample += 4) {
+    if ((sample[0] & 3) == 0 && sample[1] == sample[0] + 1 && sample[2] == sample[0] + 2 && sample[3] == sample[0] + 3) target[b] = source[sample[0] >> 2];
+    else target[b] = sample_code(source, sample[0]) | sample_code(source, sample[1]) << 2 | sample_code(source, sample[2]) << 4 | sample_code(source, sample[3]) << 6;
+  }
+  if (full < data.packed_bytes) {
+    unsigned char last = 0;
+    for (int j = 0; j < data.no_indiv - 4*full; j++) last |= sample_code(source, sample[j]) << (2*j);
+    target[full] = last;
+  }
+  return (const char*) target;
+}
+
+// .bed codes by rounded value: hom1 = 00, missing = 01, het = 10, hom2 = 11
+const char* GenoData::Reader::encode_values(const float* values) {
+  unsigned char* target = (unsigned char*) sample_buffer.get_data();
+  memset(target, 0, data.packed_bytes);
+  const int* sample = data.sample.empty() ? 0 : &data.sample[0];
+  for (int j = 0; j < data.no_indiv; j++) {
+    float value = values[sample ? sample[j] : j];
+    int code = !(value > -0.5f && value < 2.5f) ? 1 : (value < 0.5f ? 0 : (value < 1.5f ? 2 : 3));
+    target[j/4] |= code << (2*(j%4));
+  }
+  return (const char*) target;
+}
+
+template<typename T>
+pair<int,int> GenoData::Reader::load_block(T* target, vector<pair<int,int> >& pos_target, int offset, int total) {
+  if (offset < 0 || offset >= data.no_snps) return pair<int,int>(0,0);
   
-  char *raw = raw_buffer.get_data();
-  bed_file.seekg(block_count*offset + 3);
+  data.advise(offset, total);
+  chrono::steady_clock::time_point start = chrono::steady_clock::now();
 
   int no_loaded = 0, no_read = 0;
-  for (int curr = offset; curr < no_snps; curr++) {
-    bed_file.read(raw, block_count); no_read++;
-    if (position[curr] > 0 && process_snp(raw, target)) {pos_target.push_back(pair<int,int>(position[curr],curr)); no_loaded++;}  
+  for (int curr = offset; curr < data.no_snps; curr++) {
+    const char* raw = get_snp(curr); no_read++;
+    if (data.position[curr] > 0 && process_snp(raw, target)) {pos_target.push_back(pair<int,int>(data.position[curr],curr)); no_loaded++;}  
     if (no_loaded >= total) break;    
   }
+  if (data.evict_read || data.stream) data.release(offset, no_read);
+  snps_read += no_read; decode_time += chrono::duration<double>(chrono::steady_clock::now() - start).count();
   return pair<int,int>(no_loaded, no_read);
 }
 
-bool GenoData::process_snp(char* raw, float*& target) {
-  char* geno = geno_buffer.get_data(); unsigned char* sub_buffer = 0;
-  int counts[4] = {0,0,0,0}; int sub_i = 0; 
+bool GenoData::Reader::check_snp(int index) {
+  if (index < 0 || index >= data.no_snps || data.position[index] <= 0) return false;
+
+  const char* raw = get_snp(index); snps_read++;
+  int counts[4];
+  data.count_genotypes(raw, counts);
+
+  float mean, sd;
+  return data.snp_stats(counts, mean, sd);
+}
+
+// SNPs are filtered on the genotype counts before anything is expanded
+bool GenoData::Reader::process_snp(const char* raw, float*& target) {
+  int counts[4];
+  data.count_genotypes(raw, counts);
+
+  float mean, sd;
+  if (!data.snp_stats(counts, mean, sd)) return false;
+
+  float values[4] = {(0 - mean) / sd, 0, (1 - mean) / sd, (2 - mean) / sd}; //by .bed code: hom1, missing, het, hom2
+  Kernels::expand_codes(level, (const unsigned char*) raw, data.no_indiv, values, target);
+  target += data.no_indiv;
 
-  for (int i = 0; i < no_indiv; i++) {
-    if (i % 4 == 0) {sub_i = 0; sub_buffer = geno_index[(unsigned char) raw[i/4]];}
-    geno[i] = sub_buffer[sub_i++];
-    counts[geno[i]]++;
+  return true;
+}
+
+namespace {
+  // gathers the bits at even positions of x into the lower 32 bits
+  inline PackedWord compact_bits(PackedWord x) {
+    x &= 0x5555555555555555ULL;
+    x = (x | (x >> 1)) & 0x3333333333333333ULL;
+    x = (x | (x >> 2)) & 0x0F0F0F0F0F0F0F0FULL;
+    x = (x | (x >> 4)) & 0x00FF00FF00FF00FFULL;
+    x = (x | (x >> 8)) & 0x0000FFFF0000FFFFULL;
+    return (x | (x >> 16)) & 0x00000000FFFFFFFFULL;
   }
-  
-  float sum = 0, sq = 0, nonzero = 0;
-  for (int i = 1; i < 4; i++) {sum += (i-1)*counts[i]; sq += (i-1)*(i-1)*counts[i]; nonzero += (counts[i] != 0);}
-  float mean = sum / no_indiv, freq = sum / (2*(no_indiv - counts[0]));
+}
 
-  sq += counts[0]*mean*mean;
-  float sd = (sq - mean*sum) / (no_indiv-1); sd = sd > 0 ? sqrt(sd) : 0;
+// bitplanes per 64 individuals: hom1 = 00, missing = 01, het = 10, hom2 = 11 in the .bed encoding; pop counts the bits set in each plane
+void GenoData::Reader::pack_planes(const char* raw, PackedWord* ge1, int pop[3]) {
+  int no_indiv = data.no_indiv, no_words = data.no_words, bytes = data.packed_bytes;
+  PackedWord *eq2 = ge1 + no_words, *valid = eq2 + no_words;
+  pop[0] = pop[1] = pop[2] = 0;
 
-  if (nonzero < 2 || min(freq, 1-freq) < maf_thresh || sd <= 0) return false;
-  
-  float values[4] = {0};
-  for (int i = 1; i < 4; i++) values[i] = ((i-1) - mean) / sd;
-  for (int i = 0; i < no_indiv; i++) *(target++) = values[geno[i]];
+  for (int w = 0; w < no_words; w++) {
+    PackedWord chunk[2] = {0,0}; int start = w*16;
+    memcpy(chunk, raw + start, min(16, bytes - start));
+
+    PackedWord planes[3] = {0,0,0};
+    for (int c = 0; c < 2; c++) {
+      PackedWord low = chunk[c], high = chunk[c] >> 1;
+      planes[0] |= compact_bits(high) << (32*c);
+      planes[1] |= compact_bits(high & low) << (32*c);
+      planes[2] |= compact_bits(high | ~low) << (32*c);
+    }
+    if (w == no_words-1 && no_indiv % 64) {
+      PackedWord mask = (1ULL << (no_indiv % 64)) - 1;
+      for (int p = 0; p < 3; p++) planes[p] &= mask;
+    }
+
+    ge1[w] = planes[0]; eq2[w] = planes[1]; valid[w] = planes[2];
+    for (int p = 0; p < 3; p++) pop[p] += __builtin_popcountll(planes[p]);
+  }
+}
+
+bool GenoData::Reader::process_snp(const char* raw, PackedWord*& target) {
+  int pop[3];
+  pack_planes(raw, target + packed_header, pop);
+
+  int counts[4] = {data.no_indiv - pop[2], pop[2] - pop[0], pop[0] - pop[1], pop[1]};
+  PackedStats stats; 
+  if (!data.snp_stats(counts, stats.mean, stats.sd)) return false;
+  stats.sum = pop[0] + pop[1]; stats.count = pop[2];
 
+  memcpy(target, &stats, sizeof(PackedStats));
+  target += data.get_packed_rows();
   return true;
 }
 
-pair<int,int> GenoData::load_data(Buffer<float>& target, vector<pair<int,int> >& pos_target, int offset, int total) {
-  if (target.nrow() != no_indiv || target.ncol() != total) target.resize(no_indiv, total);
+bool GenoData::Reader::count_snp(int index, int counts[4]) {
+  if (index < 0 || index >= data.no_snps || data.position[index] <= 0) return false;
+  data.count_genotypes(get_snp(index), counts); snps_read++;
+  return true;
+}
+
+bool GenoData::Reader::pack_snp(int index, PackedWord* target) {
+  if (index < 0 || index >= data.no_snps || data.position[index] <= 0) return false;
+  int pop[3];
+  pack_planes(get_snp(index), target, pop); snps_read++;
+  return true;
+}
+
+pair<int,int> GenoData::Reader::load_data(Buffer<float>& target, vector<pair<int,int> >& pos_target, int offset, int total) {
+  if (target.nrow() != data.no_indiv || target.ncol() != total) target.resize(data.no_indiv, total);
+  return load_block(target.get_data(), pos_target, offset, total);
+}
+
+pair<int,int> GenoData::Reader::load_data(Buffer<PackedWord>& target, vector<pair<int,int> >& pos_target, int offset, int total) {
+  int rows = data.get_packed_rows();
+  if (target.nrow() != rows || target.ncol() != total) target.resize(rows, total);
   return load_block(target.get_data(), pos_target, offset, total);
 }
 
+} // namespace ldblock
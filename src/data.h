@@ -6,9 +6,13 @@
 #include <vector>
 #include <fstream>
 #include <cstring>
+#include <atomic>
+#include <mutex>
 
 #include "global.h"
 
+namespace ldblock {
+
 namespace DataUtils {
   template<typename T>
   static bool check_zero_bits() {
@@ -87,37 +91,193 @@ namespace DataUtils {
 };
 
 
+// array memory from the heap, or from an unlinked temporary file when a directory is given, so that its pages can be written out
+// and dropped from memory instead of counting against the process as anonymous memory
+class SpillBuffer {
+  char* content;
+  long long bytes;
+  bool mapped;
+
+  SpillBuffer(const SpillBuffer& other);
+  SpillBuffer& operator=(const SpillBuffer& other);
+
+public:
+  SpillBuffer(long long size, const string& dir = "", bool zero = false); //mapped memory is always zero
+  ~SpillBuffer();
+
+  char* get_data() {return content;}
+  long long size() {return bytes;}
+  bool is_mapped() {return mapped;}
+
+  void evict(long long from, long long to); //drops the pages within bytes [from,to) from memory, if mapped
+};
+
+
+// forward-only reader of a .bed file that cannot be mapped (a pipe or standard input), SNPs are read on demand in chunks
+// and kept until released; released chunks are freed unless retain is set, so that a later pass can read them again
+class BedStream {
+  int fd;
+  long long snp_bytes;
+  int no_snps, chunk_snps, released;
+  vector<char*> chunks;
+  atomic<int> loaded; //SNPs read so far
+  bool retain;
+  mutex lock;
+  unsigned long long hash; //fingerprint, with sampled SNPs added as they are read
+
+  BedStream(const BedStream& other);
+  BedStream& operator=(const BedStream& other);
+
+  void fetch(int count); //reads until at least count SNPs are loaded
+
+public:
+  BedStream(int fd, long long snp_bytes, int no_snps, unsigned long long hash);
+  ~BedStream();
+
+  const char* get(int index) {
+    if (index >= loaded) fetch(index+1);
+    if (!chunks[index / chunk_snps]) error("streamed .bed file was read out of order");
+    return chunks[index / chunk_snps] + (index % chunk_snps)*snp_bytes;
+  }
+  void release(int count); //SNPs before count will not be read again
+  void set_retain(bool keep) {retain = keep;}
+  bool get_retain() {return retain;}
+  unsigned long long get_hash(); //reads the remainder of the file
+};
+
+
+typedef unsigned long long PackedWord;
+
+// header of a bit-packed SNP column, followed by three bitplanes (genotype >= 1, genotype == 2, non-missing)
+struct PackedStats {
+  float mean, sd;
+  int sum, count; //sum of genotype values, number of non-missing genotypes
+};
+
+
+// genotypes held by the caller, used in place for as long as the GenoData reading them exists; either SNP-major packed
+// as in a .bed file without its 3 byte header ((no_indiv+3)/4 bytes per SNP), or as values 0, 1 or 2 (NAN for missing)
+// in a float matrix with a column of no_indiv values per SNP, which are rounded to the nearest genotype
+struct GenoInput {
+  int no_indiv;
+  vector<string> chr; vector<int> position; //of each SNP, SNPs with position 0 are skipped
+  const char* packed; const float* values; //one of these
+
+  GenoInput() : no_indiv(0), packed(0), values(0) {}
+};
+
+
 class GenoData {
+  struct Segment {
+    string chr; int from, to; //consecutive SNPs [from,to) on the same chromosome
+    Segment(const string& chr, int from) : chr(chr), from(from), to(from) {}
+  };
+
   string prefix;
   float maf_thresh;
+  int threads; //for parsing the .bim file
+  ostream* log; //for progress messages while reading the input files
 
-  ifstream bed_file; 
-  unsigned long long block_count;
-  Buffer<char> raw_buffer, geno_buffer;   
-  unsigned char geno_index[256][4]; 
+  const char *map_data, *bed_data; //read-only mapping of the .bed file, and start of the data for this object in it
+  unsigned long long map_size, block_count;
+  bool owner; //false for a view on the mapping of another object
+  bool evict_read; //drop pages of the .bed file from memory once they have been read
+  string bed_file;
+  BedStream* stream; //instead of the mapping, if the .bed file is not a regular file
+  bool float_input; //bed_data points to float values of the caller instead of packed genotypes
+  int no_words; //64-bit words per bitplane
+  int packed_bytes; //size of a SNP after selecting the individuals in sample
+  vector<int> sample; //indices in the .fam file of the individuals to use, empty for all
 
   int no_indiv, no_snps;
+  Region region; int first_snp, file_snps; //SNPs [first_snp, first_snp + no_snps) of the file_snps in the .bim file are loaded
   vector<int> position; //set to zero to skip
   pair<int,int> pos_bounds;
+  vector<Segment> segments;
+  double bim_time; //seconds spent parsing the .bim file
+
+  GenoData(GenoData& source, const Segment& segment);
+  GenoData(GenoData& source, const string& name, const vector<int>& sample);
 
   void read_fam();
   void read_bim();
+  bool read_index(const string& fname, const char* bim, unsigned long long bim_size); //false if there is no valid index
+  void select_region();
   void prep_bed();
+  void skip_bed(); //dimensions only, reading genotypes is an error
+  void set_bounds();
+  unsigned long long hash_positions(); //start of the fingerprint
   
-  bool process_snp(char* raw, float*& target);
-  pair<int,int> load_block(float* target, vector<pair<int,int> >& pos_target, int offset, int total);
-  
+  void count_genotypes(const char* raw, int counts[4]); //missing, hom1, het, hom2
+  const char* get_raw(int index) {return stream ? stream->get(index) : bed_data + block_count*index;}
+  void advise(int index, int count); //hint that SNPs from index onward will be read shortly
+  void release(int index, int count);
+
 public:
-  GenoData(const string& prefix, float maf_thresh);
+  class Reader;
+  static const int packed_header = sizeof(PackedStats) / sizeof(PackedWord);
 
+  GenoData(const string& prefix, float maf_thresh, const string& bed_file = "", const Region& region = Region(), int threads = 1, ostream& log = cout, bool genotypes = true); //bed_file replaces <prefix>.bed, '-' for standard input; without genotypes only the .bim and .fam files are read
+  GenoData(const GenoInput& input, float maf_thresh); //genotypes are not copied
+  ~GenoData();
+
+  bool snp_stats(int counts[4], float& mean, float& sd); //whether a SNP with these genotype counts (missing, hom1, het, hom2) passes filtering
   void set_thresh(float thresh) {maf_thresh = thresh;}
-  pair<int,int> load_data(Buffer<float>& target, vector<pair<int,int> >& pos_target, int offset, int total);
+  void set_evict(bool evict) {evict_read = evict;}
+  void set_retain(bool retain) {if (stream) stream->set_retain(retain);} //keep a streamed .bed in memory for passes after the first
+  bool is_streamed() {return stream != 0;}
+  bool is_sequential() {return stream && !stream->get_retain();} //SNPs can only be read once, in order
+  float get_thresh() {return maf_thresh;}
+  unsigned long long get_fingerprint(); //hash of the dimensions, positions and a sample of the genotypes
   
   int get_nrow() {return no_indiv;}
+  int get_packed_rows() {return packed_header + 3*no_words;}
   int get_nsnps() {return no_snps;}
+  int get_position(int index) {return position[index];} //0 for SNPs that are skipped
+  long long get_snp_bytes() {return block_count;} //size of a SNP in the .bed file, or in the float values
+  double get_bim_time() {return bim_time;}
   pair<int,int> get_bounds() {return pos_bounds;}
+
+  int get_nchr() {return segments.size();}
+  const string& get_chr(int index) {return segments[index].chr;}
+  int get_chr_size(int index) {return segments[index].to - segments[index].from;}
+  GenoData* get_chromosome(int index) {return new GenoData(*this, segments[index]);} //view sharing the .bed mapping, only valid while this object exists
+  GenoData* get_population(const string& name, const string& keep_file); //view on the individuals listed (FID IID) in keep_file
+  GenoData* get_subsample(int size, unsigned int seed); //view on a random subset of the individuals
+};
+
+// decoding state on the shared .bed mapping, for reading from multiple threads
+class GenoData::Reader {
+  GenoData& data;
+  int level; //Kernels::Level for expanding genotypes
+  Buffer<char> sample_buffer; //genotypes of the selected individuals, packed as in the .bed file
+  long long snps_read; double decode_time; //totals for this reader
+
+  static unsigned char sample_code(const unsigned char* raw, int index) {return raw[index >> 2] >> ((index & 3) << 1) & 3;}
+  const char* get_snp(int index);
+  const char* encode_values(const float* values); //into sample_buffer
+  bool process_snp(const char* raw, float*& target);
+  bool process_snp(const char* raw, PackedWord*& target);
+  void pack_planes(const char* raw, PackedWord* target, int pop[3]); //bitplanes only, without PackedStats header
+  template<typename T> pair<int,int> load_block(T* target, vector<pair<int,int> >& pos_target, int offset, int total);
+
+public:
+  Reader(GenoData& data);
+
+  bool check_snp(int index); //whether SNP at index passes filtering
+  bool count_snp(int index, int counts[4]); //genotype counts of SNP at index without filtering, false if it is skipped
+  bool pack_snp(int index, PackedWord* target); //bitplanes of SNP at index without filtering or header, false if it is skipped
+  pair<int,int> load_data(Buffer<float>& target, vector<pair<int,int> >& pos_target, int offset, int total);
+  pair<int,int> load_data(Buffer<PackedWord>& target, vector<pair<int,int> >& pos_target, int offset, int total);
+
+  GenoData& get_data() {return data;}
+  void set_level(int kernel_level) {level = kernel_level;}
+  long long get_snps_read() {return snps_read;}
+  double get_decode_time() {return decode_time;} //seconds spent reading and standardizing SNPs in load_data
 };
 
 
+} // namespace ldblock
+
 #endif /* DATA_H */
 
@@ -4,16 +4,72 @@
 #define GLOBAL_H
 
 #include <iostream>
+#include <fstream>
 #include <sstream> 
+#include <vector>
+#include <cstdlib>
+#include <climits>
+#include <stdexcept>
+#include <exception>
+#include <mutex>
 #include <sys/stat.h>
 
+namespace ldblock {
+
 using namespace std;
 
+// errors are thrown, so that a program using the library can report them; the exit code is for the ldblock program
+class LdblockError : public runtime_error {
+  int code;
+public:
+  LdblockError(const string& msg, int code) : runtime_error(msg), code(code) {}
+  int get_code() const {return code;}
+};
+
 static void error(const string& msg, int code=1) {
-  cerr << endl << "ERROR: " << msg << endl;
-  exit(code);  
+  throw LdblockError(msg, code);
 }
 
+// first error thrown in any of a group of worker threads, rethrown by the thread that joins them
+class ThreadErrors {
+  mutex lock;
+  exception_ptr first;
+
+public:
+  void store() {lock_guard<mutex> guard(lock); if (!first) first = current_exception();} //from within a catch block
+  bool failed() {lock_guard<mutex> guard(lock); return (bool) first;}
+  void rethrow() {if (first) rethrow_exception(first);}
+};
+
+struct SplitConfig {
+  int split_size; double split_prop;
+  double metric_margin, metric_max;
+  SplitConfig(int size, double prop, double margin, double max) : split_size(size), split_prop(prop), metric_margin(margin), metric_max(max) {}
+};
+
+// SNPs to load from a genome-wide fileset: those on a chromosome, with base pair position in [from_bp, to_bp]
+struct Region {
+  string chr; int from_bp, to_bp;
+  bool use_index; //read the .bim through its sidecar index <prefix>.bim.idx, creating it if needed
+  Region() : from_bp(0), to_bp(INT_MAX), use_index(false) {}
+
+  bool empty() const {return chr.empty();}
+  string name() const {
+    ostringstream name; name << chr;
+    if (from_bp > 0 || to_bp < INT_MAX) name << ":" << from_bp << "-";
+    if (to_bp < INT_MAX) name << to_bp;
+    return name.str();
+  }
+};
+
+// filter on the break points before they are turned into blocks, see BreakTree; max_blocks 0 for no limit
+struct BlockFilter {
+  double max_metric; int min_size, min_size_all, max_blocks;
+  BlockFilter(double max_metric = 1, int min_size = 0, int min_size_all = 0, int max_blocks = 0) : max_metric(max_metric), min_size(min_size), min_size_all(min_size_all), max_blocks(max_blocks) {}
+
+  string name() const {ostringstream name; name << "max" << max_metric << "_size" << min_size << "_sizeall" << min_size_all << "_cap" << max_blocks; return name.str();}
+};
+
 class Settings {
   bool is_dir(const string& basename) {struct stat status; return stat(basename.c_str(), &status) == 0 && S_ISDIR(status.st_mode);}
   bool is_file(const string& filename) {
@@ -21,6 +77,16 @@ class Settings {
     int code = stat(filename.c_str(), &status);
     return code == 0 && S_ISREG(status.st_mode);
   }
+
+  void check_input(const string& prefix, bool check_bed = true) {
+    if (is_dir(prefix)) error(string("file prefix '") + prefix + "' is a directory");
+
+    string suffix[] = {".bed", ".bim", ".fam"};
+    for (int i = check_bed ? 0 : 1; i < 3; i++) {
+      string fname = prefix + suffix[i];
+      if (!is_file(fname)) error(string("file '") + fname + "' not found");                  
+    }
+  }
   
   template<typename T>
   bool convert_num(const string& value, T& target) {
@@ -28,30 +94,150 @@ class Settings {
     return !istr.fail() && istr.eof();
   } 
 
+  // parses splitter argument at index a if it is one, moving a to its value
+  bool parse_split(int argc, char* argv[], int& a) {
+    if (string(argv[a]) == "-min-size") {
+      if (argc <= a+1) error("no value specified for argument '-min-size'");
+      if (!convert_num(argv[++a], split_size)) error("value for argument '-min-size' is not a (whole) number");
+      if (split_size < 50) error("value for argument '-min-size' should be at least 50");
+    } else if (string(argv[a]) == "-split-prop") {
+      if (argc <= a+1) error("no value specified for argument '-min-prop'");
+      if (!convert_num(argv[++a], split_prop)) error("value for argument '-min-prop' is not a number");
+      if (split_prop < 0 || split_prop > 0.4) error("value for argument '-min-prop' should be between 0 and 0.4");        
+    } else if (string(argv[a]) == "-margin") {
+      if (argc <= a+1) error("no value specified for argument '-margin'");
+      if (!convert_num(argv[++a], metric_margin)) error("value for argument '-margin' is not a number");
+      if (metric_margin < 0 || metric_margin > 0.10) error("value for argument '-margin' should be between 0 and 0.1");
+    } else if (string(argv[a]) == "-max") {
+      if (argc <= a+1) error("no value specified for argument '-max'");
+      if (!convert_num(argv[++a], metric_max)) error("value for argument '-max' is not a number");
+      if (metric_max <= 0) error("value for argument '-max' should be greater than 0");
+    } else return false;
+    return true;
+  }
+
+  // each line holds splitter arguments on top of those on the command line, comma-separated values are expanded into all combinations
+  void read_sweep(const string& fname) {
+    if (!is_file(fname)) error(string("sweep file '") + fname + "' not found");
+    ifstream in(fname.c_str()); string line, token;
+    while (getline(in, line)) {
+      istringstream extract(line); vector<vector<string> > values;
+      while (extract >> token) {
+        values.push_back(vector<string>());
+        for (size_t from = 0, to; from <= token.size(); from = to + 1) {
+          to = min(token.find(',', from), token.size());
+          values.back().push_back(token.substr(from, to - from));
+        }
+      }
+      if (values.empty() || values[0][0][0] == '#') continue;
+
+      vector<int> choice(values.size(), 0);
+      for (int c = 0; c < values.size(); ) {
+        Settings config(*this); vector<string> tokens; vector<char*> args;
+        for (int i = 0; i < values.size(); i++) tokens.push_back(values[i][choice[i]]);
+        for (int i = 0; i < tokens.size(); i++) args.push_back(&tokens[i][0]);
+        for (int a = 0; a < args.size(); a++) {
+          if (!config.parse_split(args.size(), &args[0], a)) error(string("argument '") + args[a] + "' in sweep file is not a splitter setting");
+        }
+        sweep.push_back(SplitConfig(config.split_size, config.split_prop, config.metric_margin, config.metric_max));
+
+        for (c = 0; c < values.size() && ++choice[c] == values[c].size(); c++) choice[c] = 0;
+      }
+    }
+    if (sweep.empty()) error(string("sweep file '") + fname + "' does not contain any splitter settings");
+  }
+
 
 public:
   string input_pref, output_pref;
+  string bed_file; //replaces <input_pref>.bed, '-' for standard input; read as a stream if it is not a regular file
+  string save_band, load_band; //band cache files
+  int shard_from, shard_to; //full data SNPs [from,to) to compute the band for and save as a shard, -1 for the whole band
+  vector<string> merge; //band shards read from a list file, combined instead of computing the band
+  string save_stats; vector<string> merge_stats; //pair statistics of the individuals (or of the merged batches) to save, and those to merge into the band
+  int stats_window; //SNPs before filtering that the pair statistics cover, 0 to size it from the SNPs of the batch at or above stats_maf
+  double stats_maf; //MAF in the batch of the SNPs the automatic window has to cover snp_window of, negative for twice maf_thresh
   double maf_thresh;
-  int snp_window;
+  int snp_window, threads, prefetch;
+  int band_precision; //BandPrecision::Type, 0 = float, 1 = fixed16, 2 = half
+  bool precision_report; //compare compact band storage against float
+  double mem_limit; //MB, 0 for no limit
+  string tmp_dir; //for spill files under mem_limit
+  double progress; //seconds between progress lines while computing correlations, 0 for none
   
   int split_size; double split_prop;
   double metric_margin, metric_max;
-  bool print_metric, refine;
+  bool print_metric, refine, packed, simd;
+  bool band_free; //keep only the sums of the metric, recompute the band around splits
+  string sweep_file;
+  vector<SplitConfig> sweep; //splitter settings to run on the same correlations, instead of the single one
+  bool by_chr; //analyse each chromosome in the .bim file separately
+  vector<string> batch; //input prefixes read from a list file, analysed separately
+  int subsample; unsigned int seed; //individuals used to approximate the band, 0 for all
+  vector<pair<string,string> > populations; //name and keep file of each subset of individuals to analyse separately
+  vector<BlockFilter> block_filters; //blocks are written for each, none if empty
+  bool from_breaks; //only turn the existing <input_pref>.breaks file into blocks
+  Region region; //only the SNPs in it are loaded, all if empty
 
-  Settings(int argc, char* argv[]) : maf_thresh(0.01), snp_window(200), split_size(1000), split_prop(0.1), metric_margin(0.01), metric_max(0.25), print_metric(false), refine(true) {
-    if (argc < 2) error("no arguments provided");
-    if (is_dir(argv[1])) error("file prefix is a directory");
+  // default settings, for setting up an analysis without command line arguments
+  Settings() : output_pref("ldblock"), shard_from(-1), shard_to(-1), stats_window(0), stats_maf(-1), maf_thresh(0.01), snp_window(200), threads(1), prefetch(2), band_precision(0), precision_report(false), mem_limit(0), progress(10), split_size(1000), split_prop(0.1), metric_margin(0.01), metric_max(0.25), print_metric(false), refine(true), packed(false), simd(true), band_free(false), by_chr(false), subsample(0), seed(1), from_breaks(false) {
+    tmp_dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+  }
 
-    string suffix[] = {".bed", ".bim", ".fam"};
-    for (int i = 0; i < 3; i++) {
-      string fname = string(argv[1]) + suffix[i];
-      if (!is_file(fname)) error(string("file '") + fname + "' not found");                  
+  // runs that only save their part of the input to a later merge, without computing break points
+  bool partial() const {return shard_from >= 0 || !save_stats.empty();}
+  double get_stats_maf() const {return stats_maf >= 0 ? stats_maf : min(2*maf_thresh, 0.45);}
+  // the .bed file is only needed for the genotypes; merged pair statistics without refinement use the .bim and .fam files alone
+  bool needs_bed() const {return merge_stats.empty() || (refine && save_stats.empty()) || !save_band.empty();}
+
+  // limits of the arguments and the rules for combining them, also for settings that were set directly
+  void check() const {
+    if (maf_thresh < 0 || maf_thresh > 0.40) error("MAF threshold should be between 0 and 0.4");
+    if (snp_window < 1) error("SNP window should be at least 1");
+    if (threads < 1) error("number of threads should be at least 1");
+    if (stats_window < 0) error("window of the pair statistics cannot be negative");
+    if (stats_maf > 0.5) error("MAF for the window of the pair statistics should be at most 0.5");
+    if (band_precision < 0 || band_precision > 2) error("band precision should be 0 (float), 1 (fixed16) or 2 (half)");
+    if (split_size < 50) error("minimum block size should be at least 50");
+    if (split_prop < 0 || split_prop > 0.4) error("minimum proportion should be between 0 and 0.4");
+    if (metric_margin < 0 || metric_margin > 0.10) error("metric margin should be between 0 and 0.1");
+    if (metric_max <= 0) error("metric maximum should be greater than 0");
+
+    bool use_batch = !batch.empty();
+    if (!save_band.empty() && !load_band.empty()) error("arguments '-save-band' and '-load-band' cannot be combined");
+    if (region.empty() && (region.from_bp != 0 || region.to_bp != INT_MAX)) error("arguments '-from-bp' and '-to-bp' require a chromosome to be selected with '-chr'");
+    if (region.from_bp > region.to_bp) error("value for argument '-from-bp' cannot exceed that of '-to-bp'");
+    if (!region.empty() && bed_file == "-") error("argument '-chr' requires a .bed file that is not read from standard input");
+    if (!bed_file.empty()) {
+      if (use_batch || by_chr) error("argument '-bed' cannot be combined with '-batch' or '-by-chr'");
+      struct stat status;
+      if (!populations.empty() && (bed_file == "-" || (stat(bed_file.c_str(), &status) == 0 && !S_ISREG(status.st_mode)))) error("argument '-pop' requires a .bed file that is not read from a pipe");
     }
+    if (shard_from >= 0 || !merge.empty()) {
+      if (shard_from >= 0 && !merge.empty()) error("arguments '-shard' and '-merge' cannot be combined");
+      if (use_batch || by_chr || !populations.empty()) error("arguments '-shard' and '-merge' cannot be combined with '-batch', '-by-chr' or '-pop'");
+      if (band_free || !load_band.empty()) error("arguments '-shard' and '-merge' cannot be combined with '-no-band' or '-load-band'");
+      if (shard_from >= 0 && save_band.empty()) error("argument '-shard' requires a file to save the band to");
+    }
+    if (band_free && (!save_band.empty() || !load_band.empty() || !sweep.empty() || precision_report)) error("argument '-no-band' cannot be combined with '-save-band', '-load-band', '-sweep' or '-precision-report'");
+    if (!save_stats.empty() || !merge_stats.empty()) {
+      if (use_batch || by_chr || !populations.empty()) error("arguments '-save-stats' and '-merge-stats' cannot be combined with '-batch', '-by-chr' or '-pop'");
+      if (band_free || !load_band.empty() || shard_from >= 0 || !merge.empty() || subsample > 0) error("arguments '-save-stats' and '-merge-stats' cannot be combined with '-no-band', '-load-band', '-shard', '-merge' or '-subsample'");
+    }
+    if (subsample > 0 && !sweep.empty()) error("arguments '-subsample' and '-sweep' cannot be combined");
+    if (use_batch && !populations.empty()) error("arguments '-batch' and '-pop' cannot be combined");
+    if (use_batch && by_chr) error("arguments '-batch' and '-by-chr' cannot be combined");
+    if (from_breaks && (use_batch || by_chr || !populations.empty())) error("argument '-from-breaks' cannot be combined with '-batch', '-by-chr' or '-pop'");
+  }
+
+  Settings(int argc, char* argv[]) : Settings() {
+    if (argc < 2) error("no arguments provided");
     input_pref = argv[1];
-    output_pref = "ldblock";
+    bool use_batch = false; string merge_file, stats_file;
     
     for (int a = 2; a < argc; a++) {
-      if (string(argv[a]) == "-frq") {
+      if (parse_split(argc, argv, a)) continue;
+      else if (string(argv[a]) == "-frq") {
         if (argc <= a+1) error("no value specified for argument '-frq'");
         if (!convert_num(argv[++a], maf_thresh)) error("value for argument '-frq' is not a number");
         if (maf_thresh < 0 || maf_thresh > 0.40) error("value for argument '-frq' should be between 0 and 0.4");
@@ -59,37 +245,163 @@ public:
         if (argc <= a+1) error("no value specified for argument '-win'");
         if (!convert_num(argv[++a], snp_window)) error("value for argument '-win' is not a (whole) number");
         if (snp_window < 1) error("value for argument '-win' should be at least 1");
-      } else if (string(argv[a]) == "-min-size") {
-        if (argc <= a+1) error("no value specified for argument '-min-size'");
-        if (!convert_num(argv[++a], split_size)) error("value for argument '-min-size' is not a (whole) number");
-        if (split_size < 50) error("value for argument '-min-size' should be at least 50");
-      } else if (string(argv[a]) == "-split-prop") {
-        if (argc <= a+1) error("no value specified for argument '-min-prop'");
-        if (!convert_num(argv[++a], split_prop)) error("value for argument '-min-prop' is not a number");
-        if (split_prop < 0 || split_prop > 0.4) error("value for argument '-min-prop' should be between 0 and 0.4");        
-      } else if (string(argv[a]) == "-margin") {
-        if (argc <= a+1) error("no value specified for argument '-margin'");
-        if (!convert_num(argv[++a], metric_margin)) error("value for argument '-margin' is not a number");
-        if (metric_margin < 0 || metric_margin > 0.10) error("value for argument '-margin' should be between 0 and 0.1");
-      } else if (string(argv[a]) == "-max") {
-        if (argc <= a+1) error("no value specified for argument '-max'");
-        if (!convert_num(argv[++a], metric_max)) error("value for argument '-max' is not a number");
-        if (metric_max <= 0) error("value for argument '-max' should be greater than 0");
+      } else if (string(argv[a]) == "-threads") {
+        if (argc <= a+1) error("no value specified for argument '-threads'");
+        if (!convert_num(argv[++a], threads)) error("value for argument '-threads' is not a (whole) number");
+        if (threads < 1) error("value for argument '-threads' should be at least 1");
+      } else if (string(argv[a]) == "-prefetch") {
+        if (argc <= a+1) error("no value specified for argument '-prefetch'");
+        if (!convert_num(argv[++a], prefetch)) error("value for argument '-prefetch' is not a (whole) number");
+        if (prefetch < 0) error("value for argument '-prefetch' cannot be negative");
+      } else if (string(argv[a]) == "-progress") {
+        if (argc <= a+1) error("no value specified for argument '-progress'");
+        if (!convert_num(argv[++a], progress)) error("value for argument '-progress' is not a number");
+        if (progress < 0) error("value for argument '-progress' cannot be negative");
       } else if (string(argv[a]) == "-out") {
         if (argc <= a+1) error("no value specified for argument '-out'");
         output_pref = argv[++a];
+      } else if (string(argv[a]) == "-bed") {
+        if (argc <= a+1) error("no value specified for argument '-bed'");
+        bed_file = argv[++a];
+      } else if (string(argv[a]) == "-subsample") {
+        if (argc <= a+1) error("no value specified for argument '-subsample'");
+        if (!convert_num(argv[++a], subsample)) error("value for argument '-subsample' is not a (whole) number");
+        if (subsample < 2) error("value for argument '-subsample' should be at least 2");
+      } else if (string(argv[a]) == "-seed") {
+        if (argc <= a+1) error("no value specified for argument '-seed'");
+        if (!convert_num(argv[++a], seed)) error("value for argument '-seed' is not a (whole) number");
+      } else if (string(argv[a]) == "-pop") {
+        if (argc <= a+2) error("argument '-pop' requires a population name and a keep file");
+        string name = argv[++a], keep = argv[++a];
+        if (name.empty() || name.find('/') != string::npos) error(string("population name '") + name + "' is not valid");
+        for (int i = 0; i < populations.size(); i++) {if (populations[i].first == name) error(string("population '") + name + "' is specified more than once");}
+        if (!is_file(keep)) error(string("keep file '") + keep + "' not found");
+        populations.push_back(pair<string,string>(name, keep));
+      } else if (string(argv[a]) == "-save-band") {
+        if (argc <= a+1) error("no value specified for argument '-save-band'");
+        save_band = argv[++a];
+      } else if (string(argv[a]) == "-load-band") {
+        if (argc <= a+1) error("no value specified for argument '-load-band'");
+        load_band = argv[++a];
+      } else if (string(argv[a]) == "-shard") {
+        if (argc <= a+2) error("argument '-shard' requires the first and last SNP index");
+        if (!convert_num(argv[++a], shard_from) || !convert_num(argv[++a], shard_to)) error("values for argument '-shard' are not (whole) numbers");
+        if (shard_from < 0 || shard_to <= shard_from) error("values for argument '-shard' should be a non-empty range of SNP indices");
+      } else if (string(argv[a]) == "-merge") {
+        if (argc <= a+1) error("no value specified for argument '-merge'");
+        merge_file = argv[++a];
+      } else if (string(argv[a]) == "-save-stats") {
+        if (argc <= a+1) error("no value specified for argument '-save-stats'");
+        save_stats = argv[++a];
+      } else if (string(argv[a]) == "-merge-stats") {
+        if (argc <= a+1) error("no value specified for argument '-merge-stats'");
+        stats_file = argv[++a];
+      } else if (string(argv[a]) == "-stats-win") {
+        if (argc <= a+1) error("no value specified for argument '-stats-win'");
+        if (!convert_num(argv[++a], stats_window)) error("value for argument '-stats-win' is not a (whole) number");
+        if (stats_window < 1) error("value for argument '-stats-win' should be at least 1");
+      } else if (string(argv[a]) == "-stats-maf") {
+        if (argc <= a+1) error("no value specified for argument '-stats-maf'");
+        if (!convert_num(argv[++a], stats_maf)) error("value for argument '-stats-maf' is not a number");
+        if (stats_maf < 0 || stats_maf > 0.5) error("value for argument '-stats-maf' should be between 0 and 0.5");
+      } else if (string(argv[a]) == "-band-precision") {
+        if (argc <= a+1) error("no value specified for argument '-band-precision'");
+        string value = argv[++a];
+        if (value == "float") band_precision = 0;
+        else if (value == "fixed16") band_precision = 1;
+        else if (value == "half") band_precision = 2;
+        else error("value for argument '-band-precision' should be one of float, fixed16 or half");
+      } else if (string(argv[a]) == "-precision-report") {
+        precision_report = true;
+      } else if (string(argv[a]) == "-mem-limit") {
+        if (argc <= a+1) error("no value specified for argument '-mem-limit'");
+        if (!convert_num(argv[++a], mem_limit)) error("value for argument '-mem-limit' is not a number");
+        if (mem_limit <= 0) error("value for argument '-mem-limit' should be greater than 0");
+      } else if (string(argv[a]) == "-tmp-dir") {
+        if (argc <= a+1) error("no value specified for argument '-tmp-dir'");
+        tmp_dir = argv[++a];
+        if (!is_dir(tmp_dir)) error(string("directory '") + tmp_dir + "' for argument '-tmp-dir' not found");
+      } else if (string(argv[a]) == "-sweep") {
+        if (argc <= a+1) error("no value specified for argument '-sweep'");
+        sweep_file = argv[++a];
       } else if (string(argv[a]) == "-print-metric") {
         print_metric = true;
+      } else if (string(argv[a]) == "-by-chr") {
+        by_chr = true;
+      } else if (string(argv[a]) == "-batch") {
+        use_batch = true;
+      } else if (string(argv[a]) == "-no-band") {
+        band_free = true;
+      } else if (string(argv[a]) == "-blocks") {
+        if (argc <= a+4) error("argument '-blocks' requires a maximum metric, a minimum size, a minimum size for all SNPs and a maximum number of blocks");
+        BlockFilter filter;
+        if (!convert_num(argv[++a], filter.max_metric) || !convert_num(argv[++a], filter.min_size) || !convert_num(argv[++a], filter.min_size_all) || !convert_num(argv[++a], filter.max_blocks)) error("values for argument '-blocks' are not valid numbers");
+        if (filter.max_metric < 0 || filter.min_size < 0 || filter.min_size_all < 0 || filter.max_blocks < 0) error("values for argument '-blocks' cannot be negative");
+        block_filters.push_back(filter);
+      } else if (string(argv[a]) == "-chr") {
+        if (argc <= a+1) error("no value specified for argument '-chr'");
+        region.chr = argv[++a];
+      } else if (string(argv[a]) == "-from-bp") {
+        if (argc <= a+1) error("no value specified for argument '-from-bp'");
+        if (!convert_num(argv[++a], region.from_bp)) error("value for argument '-from-bp' is not a (whole) number");
+      } else if (string(argv[a]) == "-to-bp") {
+        if (argc <= a+1) error("no value specified for argument '-to-bp'");
+        if (!convert_num(argv[++a], region.to_bp)) error("value for argument '-to-bp' is not a (whole) number");
+      } else if (string(argv[a]) == "-index") {
+        region.use_index = true;
+      } else if (string(argv[a]) == "-from-breaks") {
+        from_breaks = true;
+      } else if (string(argv[a]) == "-packed") {
+        packed = true;
       } else if (string(argv[a]) == "-refine") {
         if (argc <= a+1) error("no value specified for argument '-refine'");
         string value = argv[++a];
         if (value == "1") refine = true;
         else if (value == "0") refine = false;
         else error("value for argument '-refine' should be either 0 or 1");
+      } else if (string(argv[a]) == "-simd") {
+        if (argc <= a+1) error("no value specified for argument '-simd'");
+        string value = argv[++a];
+        if (value == "1") simd = true;
+        else if (value == "0") simd = false;
+        else error("value for argument '-simd' should be either 0 or 1");
       } else error(string("unknown argument '") + argv[a] + "'");
     }
+
+    if (!sweep_file.empty()) read_sweep(sweep_file);
+    if (!bed_file.empty() && bed_file != "-") {
+      struct stat status;
+      if (stat(bed_file.c_str(), &status) != 0 || S_ISDIR(status.st_mode)) error(string("file '") + bed_file + "' not found");
+    }
+    if (!merge_file.empty()) {
+      if (!is_file(merge_file)) error(string("merge file '") + merge_file + "' not found");
+      ifstream list(merge_file.c_str()); string fname;
+      while (list >> fname) merge.push_back(fname);
+      if (merge.empty()) error(string("merge file '") + merge_file + "' does not contain any band shards");
+    }
+    if (!stats_file.empty()) {
+      if (!is_file(stats_file)) error(string("pair statistics list '") + stats_file + "' not found");
+      ifstream list(stats_file.c_str()); string fname;
+      while (list >> fname) merge_stats.push_back(fname);
+      if (merge_stats.empty()) error(string("pair statistics list '") + stats_file + "' does not contain any pair statistics files");
+    }
+    if (use_batch) {
+      if (!is_file(input_pref)) error(string("batch file '") + input_pref + "' not found");
+      ifstream list(input_pref.c_str()); string prefix;
+      while (list >> prefix) batch.push_back(prefix);
+      if (batch.empty()) error(string("batch file '") + input_pref + "' does not contain any file prefixes");
+    }
+    if (shard_from >= 0 && save_band.empty()) save_band = output_pref + ".shard";
+    if (from_breaks && block_filters.empty()) block_filters.push_back(BlockFilter());
+    check();
+
+    if (from_breaks && !is_file(input_pref + ".breaks")) error(string("file '") + input_pref + ".breaks' not found");
+    for (int i = 0; i < batch.size(); i++) check_input(batch[i]);
+    if (!use_batch && !from_breaks) check_input(input_pref, bed_file.empty() && needs_bed());
     if (maf_thresh == 0) refine = false;
   }
 }; 
 
+} // namespace ldblock
+
 #endif /* GLOBAL_H */
@@ -0,0 +1,192 @@
+/** Copyright (C) 2021 by Christiaan de Leeuw (CTG Lab, Vrije Universiteit Amsterdam), All Rights Reserved **/
+
+#include <algorithm>
+#include <cstring>
+
+#include "kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#define KERNELS_X86
+#include <immintrin.h>
+#endif
+
+namespace ldblock {
+
+using namespace std;
+
+namespace {
+  // float partial sums are accumulated per chunk of values and added to the double totals after each chunk,
+  // the chunk boundaries are fixed so every pair sees the same order of operations regardless of tiling
+  const int chunk_size = 512;
+
+  void dot_scalar(float** leads, int no_leads, float** trails, int no_trails, int n, double* out) {
+    for (int l = 0; l < no_leads; l++) {
+      for (int t = 0; t < no_trails; t++) {
+        double sum = 0; float *v1 = leads[l], *v2 = trails[t], *end = v1 + n;
+        while (v1 < end) sum += *(v1++) * *(v2++);
+        out[l*no_trails + t] = sum;
+      }
+    }
+  }
+
+  void dot_tail(float** leads, int no_leads, float** trails, int no_trails, int from, int n, double* out) {
+    for (int l = 0; l < no_leads; l++) {
+      for (int t = 0; t < no_trails; t++) {
+        double sum = 0;
+        for (int i = from; i < n; i++) sum += leads[l][i] * trails[t][i];
+        out[l*no_trails + t] += sum;
+      }
+    }
+  }
+
+  void expand_scalar(const unsigned char* raw, int from, int n, const float* table, float* out) {
+    for (int i = from; i < n; i++) out[i] = table[(raw[i/4] >> (2*(i%4))) & 3];
+  }
+
+#ifdef KERNELS_X86
+  __attribute__((target("avx2,fma")))
+  inline double hsum_avx2(__m256 v) {
+    __m256d sum = _mm256_add_pd(_mm256_cvtps_pd(_mm256_castps256_ps128(v)), _mm256_cvtps_pd(_mm256_extractf128_ps(v, 1)));
+    __m128d half = _mm_add_pd(_mm256_castpd256_pd128(sum), _mm256_extractf128_pd(sum, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+  }
+
+  // register tiles of 4 leads x 2 trails, missing columns in a tile are padded by repeating the last one
+  __attribute__((target("avx2,fma")))
+  void dot_avx2(float** leads, int no_leads, float** trails, int no_trails, int n, double* out) {
+    const int tl = 4, tt = 2, width = 8;
+    for (int i = 0; i < no_leads*no_trails; i++) out[i] = 0;
+
+    int vec_n = n - n % width;
+    for (int from = 0; from < vec_n; from += chunk_size) {
+      int to = min(from + chunk_size, vec_n);
+      for (int l0 = 0; l0 < no_leads; l0 += tl) {
+        float* lp[tl]; for (int k = 0; k < tl; k++) lp[k] = leads[min(l0+k, no_leads-1)];
+
+        for (int t0 = 0; t0 < no_trails; t0 += tt) {
+          float* tp[tt]; for (int k = 0; k < tt; k++) tp[k] = trails[min(t0+k, no_trails-1)];
+
+          __m256 acc[tl][tt];
+          for (int k = 0; k < tl; k++) {for (int j = 0; j < tt; j++) acc[k][j] = _mm256_setzero_ps();}
+          for (int i = from; i < to; i += width) {
+            __m256 trail[tt];
+            for (int j = 0; j < tt; j++) trail[j] = _mm256_loadu_ps(tp[j] + i);
+            for (int k = 0; k < tl; k++) {
+              __m256 lead = _mm256_loadu_ps(lp[k] + i);
+              for (int j = 0; j < tt; j++) acc[k][j] = _mm256_fmadd_ps(lead, trail[j], acc[k][j]);
+            }
+          }
+
+          for (int k = 0; k < tl && l0+k < no_leads; k++) {
+            for (int j = 0; j < tt && t0+j < no_trails; j++) out[(l0+k)*no_trails + t0+j] += hsum_avx2(acc[k][j]);
+          }
+        }
+      }
+    }
+    dot_tail(leads, no_leads, trails, no_trails, vec_n, n, out);
+  }
+
+  __attribute__((target("avx512f")))
+  inline double hsum_avx512(__m512 v) {
+    __m256 high = _mm256_castpd_ps(_mm512_extractf64x4_pd(_mm512_castps_pd(v), 1));
+    return _mm512_reduce_add_pd(_mm512_add_pd(_mm512_cvtps_pd(_mm512_castps512_ps256(v)), _mm512_cvtps_pd(high)));
+  }
+
+  // register tiles of 4 leads x 4 trails
+  __attribute__((target("avx512f")))
+  void dot_avx512(float** leads, int no_leads, float** trails, int no_trails, int n, double* out) {
+    const int tl = 4, tt = 4, width = 16;
+    for (int i = 0; i < no_leads*no_trails; i++) out[i] = 0;
+
+    int vec_n = n - n % width;
+    for (int from = 0; from < vec_n; from += chunk_size) {
+      int to = min(from + chunk_size, vec_n);
+      for (int l0 = 0; l0 < no_leads; l0 += tl) {
+        float* lp[tl]; for (int k = 0; k < tl; k++) lp[k] = leads[min(l0+k, no_leads-1)];
+
+        for (int t0 = 0; t0 < no_trails; t0 += tt) {
+          float* tp[tt]; for (int k = 0; k < tt; k++) tp[k] = trails[min(t0+k, no_trails-1)];
+
+          __m512 acc[tl][tt];
+          for (int k = 0; k < tl; k++) {for (int j = 0; j < tt; j++) acc[k][j] = _mm512_setzero_ps();}
+          for (int i = from; i < to; i += width) {
+            __m512 trail[tt];
+            for (int j = 0; j < tt; j++) trail[j] = _mm512_loadu_ps(tp[j] + i);
+            for (int k = 0; k < tl; k++) {
+              __m512 lead = _mm512_loadu_ps(lp[k] + i);
+              for (int j = 0; j < tt; j++) acc[k][j] = _mm512_fmadd_ps(lead, trail[j], acc[k][j]);
+            }
+          }
+
+          for (int k = 0; k < tl && l0+k < no_leads; k++) {
+            for (int j = 0; j < tt && t0+j < no_trails; j++) out[(l0+k)*no_trails + t0+j] += hsum_avx512(acc[k][j]);
+          }
+        }
+      }
+    }
+    dot_tail(leads, no_leads, trails, no_trails, vec_n, n, out);
+  }
+
+  // 8 genotypes from 2 bytes per step, each lane shifts its own code down and selects from the table
+  __attribute__((target("avx2")))
+  void expand_avx2(const unsigned char* raw, int n, const float* table, float* out) {
+    __m256 values = _mm256_setr_ps(table[0], table[1], table[2], table[3], 0, 0, 0, 0);
+    __m256i shifts = _mm256_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14), mask = _mm256_set1_epi32(3);
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+      unsigned short word; memcpy(&word, raw + i/4, sizeof(word));
+      __m256i codes = _mm256_and_si256(_mm256_srlv_epi32(_mm256_set1_epi32(word), shifts), mask);
+      _mm256_storeu_ps(out + i, _mm256_permutevar8x32_ps(values, codes));
+    }
+    expand_scalar(raw, i, n, table, out);
+  }
+
+  // 16 genotypes from 4 bytes per step
+  __attribute__((target("avx512f")))
+  void expand_avx512(const unsigned char* raw, int n, const float* table, float* out) {
+    __m512 values = _mm512_setr_ps(table[0], table[1], table[2], table[3], 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0);
+    __m512i shifts = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30), mask = _mm512_set1_epi32(3);
+    int i = 0;
+    for (; i + 16 <= n; i += 16) {
+      unsigned int word; memcpy(&word, raw + i/4, sizeof(word));
+      __m512i codes = _mm512_and_si512(_mm512_srlv_epi32(_mm512_set1_epi32(word), shifts), mask);
+      _mm512_storeu_ps(out + i, _mm512_permutexvar_ps(codes, values));
+    }
+    expand_scalar(raw, i, n, table, out);
+  }
+#endif
+}
+
+int Kernels::detect_level() {
+#ifdef KERNELS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx512f")) return avx512;
+  if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")) return avx2;
+#endif
+  return scalar;
+}
+
+const char* Kernels::level_name(int level) {
+  if (level == avx512) return "AVX-512";
+  if (level == avx2) return "AVX2";
+  return "scalar";
+}
+
+void Kernels::dot_tile(int level, float** leads, int no_leads, float** trails, int no_trails, int n, double* out) {
+  if (no_leads <= 0 || no_trails <= 0) return;
+#ifdef KERNELS_X86
+  if (level == avx512) {dot_avx512(leads, no_leads, trails, no_trails, n, out); return;}
+  if (level == avx2) {dot_avx2(leads, no_leads, trails, no_trails, n, out); return;}
+#endif
+  dot_scalar(leads, no_leads, trails, no_trails, n, out);
+}
+
+void Kernels::expand_codes(int level, const unsigned char* raw, int n, const float table[4], float* out) {
+#ifdef KERNELS_X86
+  if (level == avx512) {expand_avx512(raw, n, table, out); return;}
+  if (level == avx2) {expand_avx2(raw, n, table, out); return;}
+#endif
+  expand_scalar(raw, 0, n, table, out);
+}
+
+} // namespace ldblock
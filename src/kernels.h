@@ -0,0 +1,25 @@
+/** Copyright (C) 2021 by Christiaan de Leeuw (CTG Lab, Vrije Universiteit Amsterdam), All Rights Reserved **/
+
+#ifndef KERNELS_H
+#define KERNELS_H
+
+namespace ldblock {
+
+// vectorized dot products of standardized SNP columns, selected at runtime by CPU support
+namespace Kernels {
+  enum Level {scalar = 0, avx2 = 1, avx512 = 2};
+
+  int detect_level();
+  const char* level_name(int level);
+
+  // dot products of every lead column with every trail column over n values, stored as out[l*no_trails + t]
+  // results for a pair do not depend on the other columns in the tile
+  void dot_tile(int level, float** leads, int no_leads, float** trails, int no_trails, int n, double* out);
+
+  // n genotypes in .bed encoding (2 bits each, four per byte) expanded to floats, table holds the value of each of the four codes
+  void expand_codes(int level, const unsigned char* raw, int n, const float table[4], float* out);
+};
+
+} // namespace ldblock
+
+#endif /* KERNELS_H */
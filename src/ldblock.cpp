@@ -1,58 +1,138 @@
 /** Copyright (C) 2021 by Christiaan de Leeuw (CTG Lab, Vrije Universiteit Amsterdam), All Rights Reserved **/
 
-#include "global.h"
-#include "data.h"
-#include "correlations.h"
-#include "splitter.h"
-#include "output.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <mutex>
 
-int main(int argc, char* argv[]) {
-  Settings settings(argc, argv);  
-  Output out(settings.output_pref);
+#include "ldblock.h"
 
-  GenoData data(settings.input_pref, settings.maf_thresh);
-  cout << endl;
+using namespace ldblock;
 
-  cout << "Computing correlations..." << endl;
-  cout << "\twindow = " << settings.snp_window << endl;
-  cout << "\tMAF threshold = " << settings.maf_thresh << endl;
+// chromosomes are analysed largest first, by a pool of workers that divide the threads between them
+class Scheduler {
+  struct Job {
+    string name; GenoData* data; long long size;
+    Job(const string& name, GenoData* data) : name(name), data(data), size((long long) data->get_nrow() * data->get_nsnps()) {}
+    bool operator<(const Job& other) const {return size > other.size;}
+  };
 
-  Correlations corrs(settings.snp_window);
-  corrs.compute(data);  
-  cout << "\tretained " << corrs.get_size() << " SNPs after filtering" << endl; 
-  cout << endl;
-  CorrelationMatrix* cm = corrs.get_matrix(); //is deleted by Splitter
+  Settings& settings;
+  vector<Job> jobs;
+  atomic<int> next;
+  mutex print_lock;
+  ThreadErrors errors;
+
+  void worker(int threads);
+
+public:
+  Scheduler(Settings& settings) : settings(settings), next(0) {}
+
+  void add(const string& name, GenoData* data); //takes ownership of data
+  void run();
+  ~Scheduler() {for (int i = 0; i < jobs.size(); i++) delete jobs[i].data;}
+};
+
+void Scheduler::add(const string& name, GenoData* data) {
+  for (int i = 0; i < jobs.size(); i++) {if (jobs[i].name == name) error(string("chromosome or file name '") + name + "' occurs more than once");}
+  jobs.push_back(Job(name, data));
+}
+
+void Scheduler::run() {
+  stable_sort(jobs.begin(), jobs.end());
+  int no_workers = max(1, min(settings.threads, (int) jobs.size()));
+
+  cout << "Analysing " << jobs.size() << " chromosomes or populations with " << no_workers << " worker(s)..." << endl << endl;
+  vector<thread> workers;
+  for (int t = 0; t < no_workers; t++) workers.push_back(thread(&Scheduler::worker, this, settings.threads / no_workers));
+  for (int t = 0; t < no_workers; t++) workers[t].join();
+  errors.rethrow();
+}
+
+// progress of each chromosome is printed in one piece once it is done, so that output of workers is not interleaved
+void Scheduler::worker(int threads) {
+  Settings local = settings; local.threads = max(threads, 1);
+
+  for (int i = next++; i < jobs.size(); i = next++) {
+    Settings job = local; job.progress = 0;
+    if (!job.save_band.empty()) job.save_band += "." + jobs[i].name;
+    if (!job.load_band.empty()) job.load_band += "." + jobs[i].name;
 
-  if (settings.print_metric) {
-    out.write_metrics(cm->get_metric());
+    ostringstream log;
+    Output out(settings.output_pref + "." + jobs[i].name, log);
+    RunReport report; int breaks;
+    try {breaks = analyse(job, *jobs[i].data, out, log, report);}
+    catch (...) { //no further jobs are started, the error is reported once the running ones are done
+      errors.store(); next = jobs.size();
+      lock_guard<mutex> guard(print_lock);
+      cout << "=== " << jobs[i].name << " (" << jobs[i].data->get_nsnps() << " SNPs) ===" << endl << log.str();
+      return;
+    }
+
+    lock_guard<mutex> guard(print_lock);
+    cout << "=== " << jobs[i].name << " (" << jobs[i].data->get_nsnps() << " SNPs) ===" << endl << log.str();
+    if (breaks <= 0) cout << "WARNING: unable to find any break points with current settings, no output written" << endl;
     cout << endl;
   }
+}
 
-  Splitter analysis(settings);
-  cout << "Computing break points..." << endl;
-  cout << "\tminimum size = " << settings.split_size << endl;
-  cout << "\tminimum proportion = " << settings.split_prop << endl;
-  cout << "\tmetric margin = " << settings.metric_margin << endl;
-  cout << "\tmetric maximum = " << min(settings.metric_max, 1.0) << endl;
 
-  int breaks = analysis.run(cm);
-  if (breaks <= 0) error("unable to find any break points with current settings");
-  cout << "\tfound " << breaks << " break points" << endl;
-  cout << endl;
+int run(int argc, char* argv[]) {
+  Settings settings(argc, argv);
 
+  if (settings.from_breaks) {
+    Output out(settings.output_pref);
+    out.write_blocks(BreakTree::read(settings.input_pref + ".breaks"), settings.block_filters);
+  } else if (settings.by_chr || !settings.batch.empty() || !settings.populations.empty()) {
+    Scheduler scheduler(settings);
+    GenoData* genome = 0; vector<GenoData*> populations;
+    if (settings.by_chr || !settings.populations.empty()) {
+      genome = new GenoData(settings.input_pref, settings.maf_thresh, settings.bed_file, settings.region, settings.threads);
+      genome->set_retain(true);
+      for (int p = 0; p < settings.populations.size(); p++) populations.push_back(genome->get_population(settings.populations[p].first, settings.populations[p].second));
+
+      for (int p = 0; p < max((int) populations.size(), 1); p++) {
+        GenoData* source = populations.empty() ? genome : populations[p];
+        string name = populations.empty() ? "" : settings.populations[p].first;
+        if (!settings.by_chr) scheduler.add(name, source);
+        else for (int c = 0; c < source->get_nchr(); c++) scheduler.add(name.empty() ? source->get_chr(c) : name + "." + source->get_chr(c), source->get_chromosome(c));
+      }
+      if (!settings.by_chr) populations.clear(); //owned by the scheduler
+    } else {
+      for (int i = 0; i < settings.batch.size(); i++) {
+        string prefix = settings.batch[i]; size_t last = prefix.find_last_of('/');
+        scheduler.add(last != string::npos ? prefix.substr(last+1) : prefix, new GenoData(prefix, settings.maf_thresh, "", settings.region, settings.threads));
+      }
+    }
+    cout << endl;
+
+    scheduler.run();
+    for (int p = 0; p < populations.size(); p++) delete populations[p];
+    delete genome;
+  } else {
+    Output out(settings.output_pref);
+    RunReport report; Timer timer;
+    GenoData data(settings.input_pref, settings.maf_thresh, settings.bed_file, settings.region, settings.threads, cout, settings.needs_bed());
+    data.set_retain(settings.refine || settings.band_free || settings.subsample > 0); //-no-band and -subsample compute correlations again around the break points
+    report.add_stage("read_input", timer);
+    cout << endl;
+
+    if (analyse(settings, data, out, cout, report) <= 0 && !settings.partial()) error("unable to find any break points with current settings");
+  }
 
-  if (settings.refine) {
-    Refiner refiner(data);
-    cout << "Refining break points for unfiltered data..." << endl;
-    refiner.refine(analysis, corrs);
-    out.write(refiner.get_breaks(), refiner.get_positions(), data);
-  } else out.write(analysis.get_breaks(), corrs.get_positions(), data);
 
-  
   cout << endl;
   cout << "Analysis complete. Goodbye." << endl;
   cout << endl;
 
   return 0;
 }
- 
+
+int main(int argc, char* argv[]) {
+  try {
+    return run(argc, argv);
+  } catch (LdblockError& e) {
+    cerr << endl << "ERROR: " << e.what() << endl;
+    return e.get_code();
+  }
+}
@@ -1 +1,20 @@
+/** Copyright (C) 2021 by Christiaan de Leeuw (CTG Lab, Vrije Universiteit Amsterdam), All Rights Reserved **/
 
+#ifndef LDBLOCK_H
+#define LDBLOCK_H
+
+// public header of the ldblock library (libldblock.a), of which the ldblock program is a client
+// a typical use sets up Settings, a GenoData from PLINK files or from a GenoInput in memory, calls find_breaks,
+// and filters the break points into blocks with a BreakTree;
+// the classes of each stage (Correlations, CorrelationMatrix, Splitter, Refiner) can also be used directly
+
+#include "global.h"
+#include "data.h"
+#include "correlations.h"
+#include "splitter.h"
+#include "output.h"
+#include "report.h"
+#include "blocks.h"
+#include "analysis.h"
+
+#endif /* LDBLOCK_H */
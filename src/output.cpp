@@ -6,37 +6,90 @@
 
 #include "output.h"
 
-void Output::write(const vector<Split>& break_points, const vector<pair<int,int> >& positions, GenoData& data) {
-  string out_name = out_pref + ".breaks";
-  cout << "Writing break point output to file '" << out_name << "'" << endl; 
+namespace ldblock {
 
+vector<BreakPoint> Output::make_breakpoints(const vector<Split>& break_points, const vector<pair<int,int> >& positions) {
   vector<int> order = Sorter(break_points).run();
+  vector<BreakPoint> result(break_points.size());
+  for (int i = 0; i < break_points.size(); i++) {
+    const Split& curr = break_points[order[i]]; BreakPoint& target = result[i];
+    target.rank = order[i]+1; target.metric = curr.metric; target.metric_min = curr.metric_min;
+    target.index_filt = curr.offset; target.index_all = positions[curr.offset].second;
+    target.pos_lower = positions[curr.offset].first; target.pos_upper = positions[curr.offset+1].first;
+    target.position = curr.position >= 0 ? curr.position : round((target.pos_lower + target.pos_upper)/2.0);
+  }
+  return result;
+}
+
+// the first and last line are the ends of the data, with rank 0
+void Output::write(const vector<Split>& break_points, const vector<pair<int,int> >& positions, GenoData& data) {
   pair<int,int> bounds = data.get_bounds();
-  
+  BreakPoint first = {0, 0, 0, 0, 0, bounds.first, -1, -1}, last = {0, 0, 0, (int) positions.size(), data.get_nsnps(), bounds.second, -1, -1};
+  rows = make_breakpoints(break_points, positions);
+  rows.insert(rows.begin(), first); rows.push_back(last);
+  if (in_memory()) return;
+
+  string out_name = out_pref + ".breaks";
+  log << "Writing break point output to file '" << out_name << "'" << endl; 
   ofstream out(out_name.c_str());
   out << "RANK\tMETRIC\tMETRIC_MIN\tINDEX_FILT\tINDEX_ALL\tPOSITION\tPOS_LOWER\tPOS_UPPER" << endl;
-  out << "0\t0\t0\t0\t0\t" << bounds.first << "\tNA\tNA" << endl;
-  for (int i = 0; i < break_points.size(); i++) {
-    Split curr = break_points[order[i]];
+  for (int i = 0; i < rows.size(); i++) {
+    BreakPoint& curr = rows[i];
+    out << curr.rank << "\t" << curr.metric << "\t" << curr.metric_min << "\t" << curr.index_filt << "\t" << curr.index_all << "\t" << curr.position << "\t";
+    if (curr.rank == 0) out << "NA\tNA" << endl;
+    else out << curr.pos_lower << "\t" << curr.pos_upper << endl;
+  }
+}
 
-    out << (order[i]+1) << "\t" << curr.metric << "\t" << curr.metric_min << "\t" << curr.offset << "\t" << positions[curr.offset].second << "\t";    
-    int lower = positions[curr.offset].first, upper = positions[curr.offset+1].first;
-    if (curr.position < 0) curr.position = round((lower + upper)/2.0);
-    out << curr.position << "\t" << lower << "\t" << upper << endl;
+void Output::write_blocks(const vector<BreakPoint>& break_rows, const vector<BlockFilter>& filters) {
+  if (in_memory()) return;
+  BreakTree tree(break_rows);
+  vector<vector<LdBlock> > blocks = tree.make_blocks(filters);
+
+  for (int f = 0; f < filters.size(); f++) {
+    string out_name = out_pref + (filters.size() > 1 ? "." + filters[f].name() : "") + ".blocks";
+    log << "Writing " << blocks[f].size() << " blocks to file '" << out_name << "'" << endl;
+    ofstream out(out_name.c_str());
+    out << "start\tstop\tsize.filt\tsize.all" << endl;
+    for (int i = 0; i < blocks[f].size(); i++) out << blocks[f][i].start << "\t" << blocks[f][i].stop << "\t" << blocks[f][i].size_filt << "\t" << blocks[f][i].size_all << endl;
   }
-  out << "0\t0\t0\t" << positions.size() << "\t" << data.get_nsnps() << "\t" << bounds.second << "\tNA\tNA" << endl;
 }
 
 void Output::write_metrics(const vector<double>& metrics) {
+  if (in_memory()) return;
   string out_name = out_pref + ".metric";
-  cout << "Writing base metric values to file '" << out_name << "'" << endl; 
+  log << "Writing base metric values to file '" << out_name << "'" << endl; 
   ofstream out(out_name.c_str());
   for (int i = 0; i < metrics.size(); i++) out << metrics[i] << endl;  
 }
 
+void Output::write_approx(const vector<Split>& break_points, const vector<double>& approx, const vector<pair<int,int> >& positions) {
+  if (in_memory()) return;
+  string out_name = out_pref + ".approx";
+  log << "Writing approximate and exact metric values to file '" << out_name << "'" << endl;
+
+  vector<int> order = Sorter(break_points).run();
+  ofstream out(out_name.c_str());
+  out << "RANK\tINDEX_ALL\tMETRIC_APPROX\tMETRIC_EXACT\tDIFFERENCE" << endl;
+  for (int i = 0; i < break_points.size(); i++) {
+    const Split& curr = break_points[order[i]];
+    out << (order[i]+1) << "\t" << positions[curr.offset].second << "\t" << approx[order[i]] << "\t" << curr.metric << "\t" << approx[order[i]] - curr.metric << endl;
+  }
+}
+
+void Output::write_report(RunReport& report) {
+  if (in_memory()) return;
+  string out_name = out_pref + ".run.json";
+  log << "Writing run report to file '" << out_name << "'" << endl;
+  ofstream out(out_name.c_str());
+  report.write(out);
+}
+
 vector<int> Output::Sorter::run() {
   vector<int> index(data.size());
   for (int i = 0; i < index.size(); i++) index[i] = i;
   sort(index.begin(), index.end(), SortObj(*this));  
   return index;
 }
+
+} // namespace ldblock
@@ -6,17 +6,35 @@
 #include "correlations.h"
 #include "splitter.h"
 #include "data.h"
+#include "report.h"
+#include "blocks.h"
 
+namespace ldblock {
+
+// without a prefix no files are written, and the break points are kept in memory instead
 class Output {
   string out_pref;
+  ostream& log;
+  vector<BreakPoint> rows; //lines of the last .breaks output
 
   class Sorter;
 
 public:
-  Output(const string& pref) : out_pref(pref) {}
+  Output(const string& pref, ostream& log = cout) : out_pref(pref), log(log) {}
+  Output(ostream& log) : log(log) {}
+
+  const string& get_prefix() {return out_pref;}
+  bool in_memory() {return out_pref.empty();}
+  const vector<BreakPoint>& get_rows() {return rows;} //including the lines of rank 0 for the ends of the data
+  vector<BreakPoint> get_breakpoints() {return rows.size() > 2 ? vector<BreakPoint>(rows.begin() + 1, rows.end() - 1) : vector<BreakPoint>();}
+
+  static vector<BreakPoint> make_breakpoints(const vector<Split>& break_points, const vector<pair<int,int> >& positions); //in order of position
 
   void write(const vector<Split>& break_points, const vector<pair<int,int> >& positions, GenoData& data);
   void write_metrics(const vector<double>& metrics);
+  void write_report(RunReport& report);
+  void write_blocks(const vector<BreakPoint>& break_rows, const vector<BlockFilter>& filters); //<out>.blocks, or <out>.<filter>.blocks for several
+  void write_approx(const vector<Split>& break_points, const vector<double>& approx, const vector<pair<int,int> >& positions);
 }; 
 
 class Output::Sorter {
@@ -36,4 +54,6 @@ public:
 };
 
 
+} // namespace ldblock
+
 #endif /* OUTPUT_H */
@@ -0,0 +1,45 @@
+/** Copyright (C) 2021 by Christiaan de Leeuw (CTG Lab, Vrije Universiteit Amsterdam), All Rights Reserved **/
+
+#include <sys/resource.h>
+
+#include "report.h"
+
+namespace ldblock {
+
+namespace {
+  string quote(const string& value) {
+    string result = "\"";
+    for (int i = 0; i < value.size(); i++) {
+      if (value[i] == '"' || value[i] == '\\') result += '\\';
+      result += value[i];
+    }
+    return result + "\"";
+  }
+}
+
+void RunReport::write(ostream& out) {
+  out.precision(12);
+  out << "{" << endl;
+  for (int i = 0; i < info.size(); i++) out << "  " << quote(info[i].first) << ": " << quote(info[i].second) << "," << endl;
+
+  out << "  \"stages\": [" << endl;
+  for (int i = 0; i < stages.size(); i++) {
+    out << "    {\"name\": " << quote(stages[i].name) << ", \"wall_seconds\": " << stages[i].wall << ", \"cpu_seconds\": " << stages[i].cpu << "}" << (i+1 < stages.size() ? "," : "") << endl;
+  }
+  out << "  ]," << endl;
+
+  out << "  \"counters\": {" << endl;
+  for (int i = 0; i < counters.size(); i++) out << "    " << quote(counters[i].first) << ": " << counters[i].second << (i+1 < counters.size() ? "," : "") << endl;
+  out << "  }," << endl;
+
+  out << "  \"peak_rss_mb\": " << peak_rss() << endl;
+  out << "}" << endl;
+}
+
+double RunReport::peak_rss() {
+  struct rusage usage;
+  if (getrusage(RUSAGE_SELF, &usage) != 0) return 0;
+  return usage.ru_maxrss / 1024.0;
+}
+
+} // namespace ldblock
@@ -0,0 +1,51 @@
+/** Copyright (C) 2021 by Christiaan de Leeuw (CTG Lab, Vrije Universiteit Amsterdam), All Rights Reserved **/
+
+#ifndef REPORT_H
+#define REPORT_H
+
+#include <vector>
+#include <ctime>
+
+#include "global.h"
+
+namespace ldblock {
+
+// wall clock and CPU time since construction; CPU time is for the whole process, so it includes other threads
+class Timer {
+  timespec wall_start, cpu_start;
+
+  static double diff(const timespec& from, const timespec& to) {return (to.tv_sec - from.tv_sec) + (to.tv_nsec - from.tv_nsec) * 1e-9;}
+
+public:
+  Timer() {reset();}
+
+  void reset() {clock_gettime(CLOCK_MONOTONIC, &wall_start); clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &cpu_start);}
+  double wall() {timespec now; clock_gettime(CLOCK_MONOTONIC, &now); return diff(wall_start, now);}
+  double cpu() {timespec now; clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &now); return diff(cpu_start, now);}
+};
+
+// stage timings and counters of a run, written as JSON
+class RunReport {
+  struct Stage {
+    string name; double wall, cpu;
+    Stage(const string& name, double wall, double cpu) : name(name), wall(wall), cpu(cpu) {}
+  };
+
+  vector<pair<string,string> > info;
+  vector<Stage> stages;
+  vector<pair<string,double> > counters;
+
+public:
+  void add_info(const string& name, const string& value) {info.push_back(pair<string,string>(name, value));}
+  void add_stage(const string& name, Timer& timer) {stages.push_back(Stage(name, timer.wall(), timer.cpu()));}
+  void add_stage(const string& name, double wall, double cpu) {stages.push_back(Stage(name, wall, cpu));}
+  void add_counter(const string& name, double value) {counters.push_back(pair<string,double>(name, value));}
+
+  void write(ostream& out);
+
+  static double peak_rss(); //MB, for the whole process so far
+};
+
+} // namespace ldblock
+
+#endif /* REPORT_H */
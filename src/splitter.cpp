@@ -1,12 +1,62 @@
 /** Copyright (C) 2021 by Christiaan de Leeuw (CTG Lab, Vrije Universiteit Amsterdam), All Rights Reserved **/
 
 #include <cmath>
+#include <algorithm>
 
 #include "splitter.h"
 
+namespace ldblock {
+
+void MetricTree::build(const vector<double>& values) {
+  size = values.size();
+  for (leaves = 1; leaves < size; leaves *= 2);
+  
+  tree.assign(2*leaves, HUGE_VAL);
+  for (int i = 0; i < size; i++) tree[leaves+i] = values[i];
+  for (int i = leaves-1; i > 0; i--) tree[i] = min(tree[2*i], tree[2*i+1]);
+}
+
+void MetricTree::set(int index, double value) {
+  int node = leaves + index; tree[node] = value;
+  for (node /= 2; node > 0; node /= 2) tree[node] = min(tree[2*node], tree[2*node+1]);
+}
+
+// a node inside [from,to) holds the minimum of its range, which is found by descending to the first child that has it
+int MetricTree::argmin(int node, int lo, int hi, int from, int to) {
+  if (to <= lo || hi <= from) return -1;
+  if (from <= lo && hi <= to) {
+    if (lo >= size) return -1;
+    while (node < leaves) {node = tree[2*node] == tree[node] ? 2*node : 2*node+1;}
+    return node - leaves;
+  }
+
+  int mid = (lo + hi) / 2;
+  int left = argmin(2*node, lo, mid, from, to), right = argmin(2*node+1, mid, hi, from, to);
+  if (left < 0) return right;
+  if (right < 0) return left;
+  return tree[leaves+right] < tree[leaves+left] ? right : left;
+}
+
+int MetricTree::find_first(int node, int lo, int hi, int from, int to, double thresh) {
+  if (to <= lo || hi <= from || !(tree[node] < thresh)) return -1;
+  if (hi - lo == 1) return lo;
+
+  int mid = (lo + hi) / 2, found = find_first(2*node, lo, mid, from, to, thresh);
+  return found >= 0 ? found : find_first(2*node+1, mid, hi, from, to, thresh);
+}
+
+int MetricTree::find_last(int node, int lo, int hi, int from, int to, double thresh) {
+  if (to <= lo || hi <= from || !(tree[node] < thresh)) return -1;
+  if (hi - lo == 1) return lo;
+
+  int mid = (lo + hi) / 2, found = find_last(2*node+1, mid, hi, from, to, thresh);
+  return found >= 0 ? found : find_last(2*node, lo, mid, from, to, thresh);
+}
+
+
 void Splitter::clear() {
-  for (int i = 0; i < blocks.size(); i++) delete blocks[i];
-  blocks.clear(); break_points.clear();
+  blocks = priority_queue<Block>(); block_order = 0;
+  break_points.clear();
 }
 
 Splitter::Splitter(Settings& settings) {
@@ -16,96 +66,198 @@ Splitter::Splitter(Settings& settings) {
   metric_max = settings.metric_max;
 }
 
-void Splitter::insert_block(CorrelationMatrix* block) {
-  if (!blocks.empty()) {
-    for (deque<CorrelationMatrix*>::iterator curr = blocks.begin(); curr != blocks.end(); ++curr) {
-      if (block->get_size() >= (*curr)->get_size()) {blocks.insert(curr, block); return;}
-    }
-  }
-  blocks.push_back(block);
-}
-
-int Splitter::run(CorrelationMatrix* input) {
-  clear(); blocks.push_front(input);
+// metric values are kept for the whole matrix, indexed by position of the split
+int Splitter::run(CorrelationMatrix& input) {
+  clear(); metric.build(input.get_metric());
+  int depth = input.get_depth();
+  insert_block(0, input.get_size());
   
   while (!blocks.empty()) {
-    CorrelationMatrix *cm1 = blocks.front(), *cm2; blocks.pop_front();
-    int margin = max(int(ceil(cm1->get_size() * min_prop)), min_size), curr_size = cm1->get_size();
+    Block block = blocks.top(); blocks.pop();
+    int begin = block.begin, curr_size = block.size();
+    int margin = max(int(ceil(curr_size * min_prop)), min_size);
     
     if (curr_size >= margin*2) {
-      Split curr; const vector<double>& metric = cm1->get_metric(); 
+      Split curr;
       
       if (curr_size > margin*2) {       
-        for (int i = margin; i < curr_size - margin; i++) {
-          if (metric[i] < curr.metric) curr.set(i, metric[i]);
-        }
+        int i = metric.argmin(begin + margin, begin + curr_size - margin);
+        if (i >= 0 && metric.get(i) < curr.metric) curr.set(i - begin, metric.get(i));
        
         if (curr.offset < 0) error("unknown failure when splitting block");
 
+        // closest candidate to the middle within the margin: last one on the left half, else first one on the right
         if (curr.metric < metric_max && metric_margin > 0) {
           int offset = min(curr.offset, int(curr_size - curr.offset)) + 1, mid = curr_size / 2, end = curr_size - offset;
           double thresh = min(curr.metric + metric_margin, metric_max);
-          for (int i = offset; i < end; i++) {
-            if (metric[i] < thresh) {
-              if (i < mid) {
-                curr.set(i, metric[i]);
-                end = curr_size - i;
-              } else {
-                if (i < (end - 1) || metric[i] < curr.metric) curr.set(i, metric[i]);
-                break;
-              }
-            }
+
+          i = offset < min(mid, end) ? metric.find_last(begin + offset, begin + min(mid, end), thresh) : -1;
+          if (i >= 0) {
+            curr.set(i - begin, metric.get(i));
+            end = curr_size - (i - begin);
           }
+
+          int from = max(offset, mid);
+          i = from < end ? metric.find_first(begin + from, begin + end, thresh) : -1;
+          if (i >= 0 && (i - begin < (end - 1) || metric.get(i) < curr.metric)) curr.set(i - begin, metric.get(i));
         }
-      } else curr.set(margin, metric[margin]);
+      } else curr.set(margin, metric.get(begin + margin));
       
       if (curr.metric < metric_max) {
-        cm2 = cm1->split(curr.offset);
-        curr.offset += cm1->get_offset();
+        int cut = begin + curr.offset + 1;
+        for (int k = max(cut - depth, begin); k < cut - 1; k++) metric.set(k, input.block_mean(begin, cut, k));
+        for (int k = cut; k < min(cut + depth, block.end - 1); k++) metric.set(k, input.block_mean(cut, block.end, k));
+
+        curr.offset += begin; curr.offset_min += begin; curr.begin = begin; curr.end = block.end;
         break_points.push_back(curr);
   
-        if (cm2->get_size() > cm1->get_size()) swap(cm1, cm2);
-        insert_block(cm1); insert_block(cm2);
-      } else delete cm1;
-    } else {delete cm1; break;}
+        if (block.end - cut > cut - begin) {insert_block(cut, block.end); insert_block(begin, cut);}
+        else {insert_block(begin, cut); insert_block(cut, block.end);}
+      }
+    } else break;
   }  
   
   return break_points.size();
 }
  
   
-void Refiner::refine(Splitter& analysis, Correlations& corrs) {
-  breaks = analysis.get_breaks(); positions = corrs.get_positions();
-  int depth = corrs.get_depth();
+// windows that overlap are merged into one cluster, unless the cluster would grow beyond cluster_size SNPs
+void Refiner::refine(const vector<Split>& filt_breaks, const vector<pair<int,int> >& filt_positions, Correlations& corrs) {
+  breaks = filt_breaks; positions = filt_positions;
+  depth = corrs.get_depth();
 
+  vector<pair<int,int> > sorted;
   for (int b = 0; b < breaks.size(); b++) {
-    Split& curr = breaks[b];
-    int lower_bound = positions[curr.offset].second, upper_bound = positions[curr.offset+1].second;
-      
-    if (upper_bound > (lower_bound+1)) {
-      int low = max(lower_bound - depth,0), high = upper_bound + depth;
+    int lower_bound = positions[breaks[b].offset].second, upper_bound = positions[breaks[b].offset+1].second;
+    if (upper_bound > (lower_bound+1)) sorted.push_back(pair<int,int>(breaks[b].offset, b));
+  }
+  sort(sorted.begin(), sorted.end());
 
-      corrs.compute_block(data, low, high); 
-      const vector<pair<int,int> >& curr_pos = corrs.get_positions();
+  order.clear(); clusters.clear();
+  for (int i = 0; i < sorted.size(); i++) {
+    Split& curr = breaks[sorted[i].second]; order.push_back(sorted[i].second);
+    int low = max(positions[curr.offset].second - depth, 0), high = positions[curr.offset+1].second + depth;
 
-      int i_lower = -1, i_upper = -1;
-      for (int i = 0; i < curr_pos.size(); i++) {
-        if (curr_pos[i].second == lower_bound) i_lower = i;
-        if (curr_pos[i].second == upper_bound) i_upper = i;
-      }
-      if (i_lower >= 0 && i_upper > i_lower) {
-        CorrelationMatrix* cm = corrs.get_matrix();
-        const vector<double>& metric = cm->get_metric();
-        
-        int i_min = i_lower; double min_value = metric[i_lower];
-        for (int i = i_lower+1; i < i_upper; i++) {
-          if (metric[i] < min_value) {i_min = i; min_value = metric[i];}
-        }
+    if (clusters.empty() || low >= clusters.back().high || high - clusters.back().low > cluster_size) clusters.push_back(Cluster(low, high, i));
+    else {clusters.back().high = max(clusters.back().high, high); clusters.back().last = i+1;}
+  }
 
-        if (i_min >= 0) curr.position = (curr_pos[i_min].first + curr_pos[i_min+1].first) / 2.0;
-        delete cm;
-      }
+  int no_workers = min(settings.threads, (int) clusters.size());
+  if (no_workers > 1) {
+    atomic<int> next(0); vector<Correlations*> local(no_workers, &corrs); vector<thread> workers; ThreadErrors errors;
+    for (int t = 1; t < no_workers; t++) local[t] = new Correlations(settings);
+    for (int t = 0; t < no_workers; t++) workers.push_back(thread(&Refiner::cluster_worker, this, local[t], &next, &errors));
+    for (int t = 0; t < no_workers; t++) workers[t].join();
+    for (int t = 1; t < no_workers; t++) delete local[t];
+    errors.rethrow();
+  } else {
+    for (int c = 0; c < clusters.size(); c++) refine_cluster(corrs, clusters[c]);
+  }
+}
+
+void Refiner::cluster_worker(Correlations* corrs, atomic<int>* next, ThreadErrors* errors) {
+  try {
+    for (int c = (*next)++; c < clusters.size(); c = (*next)++) refine_cluster(*corrs, clusters[c]);
+  } catch (...) {errors->store(); *next = clusters.size();}
+}
+
+// the window of each breakpoint is the same stretch of SNPs as when computed on its own, as a sub-block [u0,u1) of the cluster
+void Refiner::refine_cluster(Correlations& corrs, Cluster& cluster) {
+  int size = corrs.compute_block(data, cluster.low, cluster.high);
+  const vector<pair<int,int> >& curr_pos = corrs.get_positions();
+  if (size <= 0) return;
+  BandIndex& band = corrs.get_index();
+
+  vector<int> index(size);
+  for (int i = 0; i < size; i++) index[i] = curr_pos[i].second;
+
+  for (int b = cluster.first; b < cluster.last; b++) {
+    Split& curr = breaks[order[b]];
+    int lower_bound = positions[curr.offset].second, upper_bound = positions[curr.offset+1].second;
+    int low = max(lower_bound - depth, 0), high = upper_bound + depth;
+
+    int u0 = std::lower_bound(index.begin(), index.end(), low) - index.begin(), u1 = min(u0 + (high - low), size);
+    int i_lower = std::lower_bound(index.begin() + u0, index.begin() + u1, lower_bound) - index.begin();
+    int i_upper = std::lower_bound(index.begin() + u0, index.begin() + u1, upper_bound) - index.begin();
+    if (i_upper >= u1 || index[i_lower] != lower_bound || index[i_upper] != upper_bound || i_upper <= i_lower) continue;
+
+    int i_min = i_lower; double min_value = band.block_mean(u0, u1, i_lower);
+    for (int i = i_lower+1; i < i_upper; i++) {
+      double value = band.block_mean(u0, u1, i);
+      if (value < min_value) {i_min = i; min_value = value;}
     }
+    curr.position = (curr_pos[i_min].first + curr_pos[i_min+1].first) / 2.0;
   }
 }
-  
\ No newline at end of file
+
+
+// the window is widened a little beyond depth SNPs, since filtering on the full data can retain more SNPs than on the subsample
+void MetricCheck::add_window(int index, int offset, int slack) {
+  const Split& curr = breaks[index];
+  windows.push_back(Window(positions[max(offset + 1 - slack, curr.begin)].second, positions[min(offset + slack, curr.end - 1)].second + 1, index, offset));
+}
+
+// metric_min is checked at its own split when that is not the chosen one
+void MetricCheck::run(const vector<Split>& sub_breaks, const vector<pair<int,int> >& sub_positions, Correlations& corrs) {
+  breaks = sub_breaks; positions = sub_positions;
+  depth = corrs.get_depth();
+  approx.resize(breaks.size());
+  for (int b = 0; b < breaks.size(); b++) approx[b] = breaks[b].metric;
+
+  int slack = depth + depth/8 + 2;
+  windows.clear(); clusters.clear();
+  for (int b = 0; b < breaks.size(); b++) {
+    add_window(b, breaks[b].offset, slack);
+    if (breaks[b].offset_min != breaks[b].offset) add_window(b, breaks[b].offset_min, slack);
+  }
+  sort(windows.begin(), windows.end());
+
+  int high = 0;
+  for (int w = 0; w < windows.size(); w++) {
+    if (clusters.empty() || windows[w].low >= high || windows[w].high - windows[clusters.back().first].low > cluster_size) {clusters.push_back(pair<int,int>(w, w+1)); high = windows[w].high;}
+    else {clusters.back().second = w+1; high = max(high, windows[w].high);}
+  }
+
+  int no_workers = min(settings.threads, (int) clusters.size());
+  atomic<int> next(0); ThreadErrors errors;
+  if (no_workers > 1) {
+    vector<Correlations*> local(no_workers, &corrs); vector<thread> workers;
+    for (int t = 1; t < no_workers; t++) local[t] = new Correlations(settings);
+    for (int t = 0; t < no_workers; t++) workers.push_back(thread(&MetricCheck::worker, this, local[t], &next, &errors));
+    for (int t = 0; t < no_workers; t++) workers[t].join();
+    for (int t = 1; t < no_workers; t++) delete local[t];
+  } else worker(&corrs, &next, &errors);
+  errors.rethrow();
+
+  for (int b = 0; b < breaks.size(); b++) breaks[b].metric_min = breaks[b].offset_min == breaks[b].offset ? breaks[b].metric : min(breaks[b].metric_min, breaks[b].metric);
+}
+
+void MetricCheck::worker(Correlations* corrs, atomic<int>* next, ThreadErrors* errors) {
+  try {
+    for (int c = (*next)++; c < clusters.size(); c = (*next)++) check_cluster(*corrs, clusters[c].first, clusters[c].second);
+  } catch (...) {errors->store(); *next = clusters.size();}
+}
+
+void MetricCheck::check_cluster(Correlations& corrs, int first, int last) {
+  int low = windows[first].low, high = low;
+  for (int w = first; w < last; w++) high = max(high, windows[w].high);
+
+  int size = corrs.compute_block(data, low, high);
+  if (size <= 1) return;
+  const vector<pair<int,int> >& curr_pos = corrs.get_positions();
+  vector<int> full_index(size);
+  for (int i = 0; i < size; i++) full_index[i] = curr_pos[i].second;
+  BandIndex& band = corrs.get_index();
+
+  for (int w = first; w < last; w++) {
+    Split& curr = breaks[windows[w].index];
+    int u0 = std::lower_bound(full_index.begin(), full_index.end(), windows[w].low) - full_index.begin();
+    int u1 = std::lower_bound(full_index.begin(), full_index.end(), windows[w].high) - full_index.begin();
+    int cut = std::upper_bound(full_index.begin(), full_index.end(), positions[windows[w].offset].second) - full_index.begin() - 1;
+    if (cut < u0 || cut + 1 >= u1) continue;
+    if (windows[w].offset == curr.offset) curr.metric = band.block_mean(u0, u1, cut);
+    else curr.metric_min = band.block_mean(u0, u1, cut);
+  }
+}
+
+} // namespace ldblock
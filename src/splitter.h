@@ -3,47 +3,129 @@
 #ifndef SPLITTER_H
 #define SPLITTER_H
 
-#include <deque>
+#include <queue>
 
 #include "correlations.h"
 #include "data.h"
 
+namespace ldblock {
+
 struct Split {
   int offset, position; double metric, metric_min;
-  Split() : offset(-1), position(-1), metric(2), metric_min(2) {};
-  void set(int o, double m) {offset = o; metric = m; metric_min = min(metric_min, m);}
+  int begin, end; //block [begin,end) that was split
+  int offset_min; //split with metric_min
+  Split() : offset(-1), position(-1), metric(2), metric_min(2), begin(-1), end(-1), offset_min(-1) {};
+  void set(int o, double m) {offset = o; metric = m; if (m < metric_min) {metric_min = m; offset_min = o;}}
+};
+
+// block of SNPs [begin,end); larger blocks are split first, and of equal size the most recently created one
+struct Block {
+  int begin, end; long long order;
+  Block(int begin, int end, long long order) : begin(begin), end(end), order(order) {}
+
+  int size() const {return end - begin;}
+  bool operator<(const Block& other) const {return size() < other.size() || (size() == other.size() && order < other.order);}
+};
+
+// segment tree over metric values, for range minimum and threshold searches with point updates
+class MetricTree {
+  int size, leaves;
+  vector<double> tree; //node i has children 2i and 2i+1, leaves start at index leaves
+
+  int argmin(int node, int lo, int hi, int from, int to);
+  int find_first(int node, int lo, int hi, int from, int to, double thresh);
+  int find_last(int node, int lo, int hi, int from, int to, double thresh);
+
+public:
+  MetricTree() : size(0), leaves(0) {}
+
+  void build(const vector<double>& values);
+  void set(int index, double value);
+  double get(int index) {return tree[leaves+index];}
+
+  int argmin(int from, int to) {return argmin(1, 0, leaves, from, to);} //first index of minimum in [from,to), -1 if empty
+  int find_first(int from, int to, double thresh) {return find_first(1, 0, leaves, from, to, thresh);} //first index in [from,to) below thresh, -1 if none
+  int find_last(int from, int to, double thresh) {return find_last(1, 0, leaves, from, to, thresh);} //last index in [from,to) below thresh, -1 if none
 };
 
 class Splitter {
   int min_size; double min_prop;
   double metric_margin, metric_max;
 
-  deque<CorrelationMatrix*> blocks;
+  priority_queue<Block> blocks;
+  long long block_order;
+  MetricTree metric;
   vector<Split> break_points;
 
-  void insert_block(CorrelationMatrix* block);
+  void insert_block(int begin, int end) {blocks.push(Block(begin, end, block_order++));}
   void clear();
 
 public:
   Splitter(Settings& settings);
-  ~Splitter() {clear();}
 
-  int run(CorrelationMatrix* input);
+  int run(CorrelationMatrix& input);
   const vector<Split>& get_breaks() {return break_points;}
 };
 
+// breakpoints are refined in order of position, with the windows of nearby breakpoints computed together as one cluster
 class Refiner {
+  struct Cluster {
+    int low, high, first, last; //full data SNPs [low,high) for breakpoints order[first] to order[last-1]
+    Cluster(int low, int high, int first) : low(low), high(high), first(first), last(first+1) {}
+  };
+
   GenoData& data;
+  Settings& settings;
+  int depth, cluster_size;
   vector<Split> breaks;
   vector<pair<int,int> > positions;
+  vector<int> order;
+  vector<Cluster> clusters;
+
+  void refine_cluster(Correlations& corrs, Cluster& cluster);
+  void cluster_worker(Correlations* corrs, atomic<int>* next, ThreadErrors* errors);
 
 public:
-  Refiner(GenoData& data) : data(data) {data.set_thresh(0);}
+  Refiner(GenoData& data, Settings& settings) : data(data), settings(settings), depth(0), cluster_size(10000) {data.set_thresh(0);}
 
-  void refine(Splitter& analysis, Correlations& corrs);
+  void refine(Splitter& analysis, Correlations& corrs) {refine(analysis.get_breaks(), corrs.get_positions(), corrs);}
+  void refine(const vector<Split>& filt_breaks, const vector<pair<int,int> >& filt_positions, Correlations& corrs); //corrs is overwritten
 
   const vector<Split>& get_breaks() {return breaks;}
   const vector<pair<int,int> >& get_positions() {return positions;}
 };
 
+// metric at each breakpoint found on a subsample of individuals, recomputed exactly from the full data in a window around it;
+// overlapping windows are computed together as one cluster
+class MetricCheck {
+  struct Window {
+    int low, high, index, offset; //full data SNPs [low,high) for the split of breakpoint index at offset
+    Window(int low, int high, int index, int offset) : low(low), high(high), index(index), offset(offset) {}
+    bool operator<(const Window& other) const {return low < other.low;}
+  };
+
+  GenoData& data;
+  Settings& settings;
+  int depth, cluster_size;
+  vector<Split> breaks;
+  vector<double> approx; //metric values from the subsample
+  vector<pair<int,int> > positions;
+  vector<Window> windows;
+  vector<pair<int,int> > clusters; //ranges of windows
+
+  void add_window(int index, int offset, int slack);
+  void check_cluster(Correlations& corrs, int first, int last);
+  void worker(Correlations* corrs, atomic<int>* next, ThreadErrors* errors);
+
+public:
+  MetricCheck(GenoData& data, Settings& settings) : data(data), settings(settings), depth(0), cluster_size(10000) {}
+
+  void run(const vector<Split>& sub_breaks, const vector<pair<int,int> >& sub_positions, Correlations& corrs); //corrs is overwritten
+
+  const vector<Split>& get_breaks() {return breaks;} //with exact metric and metric_min values
+  const vector<double>& get_approx() {return approx;}
+};
+
+} // namespace ldblock
+
 #endif /* SPLITTER_H */